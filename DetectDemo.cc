@@ -93,7 +93,9 @@ int main(int argc, char** argv) {
         int frameCount = 0;
 
         while (true) {
-            cv::Mat frame = camera.captureImage(1000);
+            // the frame stays in its SDK buffer, released at the end of the iteration
+            const OptCamera::Frame grabbed = camera.grabFrame(1000);
+            const cv::Mat &frame = grabbed.mat();
             if (frame.empty()) {
                 if (cv::waitKey(1) == 27) break;
                 continue;
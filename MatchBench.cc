@@ -0,0 +1,479 @@
+#include <iostream>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <opencv2/opencv.hpp>
+#include "Matcher.h"
+#include "HnswIndex.h"
+#include "IvfPqIndex.h"
+#include "TemplateBank.h"
+#include "Geometry.h"
+#include "CoarseToFineLocalizer.h"
+#include "Timer.h"
+
+
+// random L2-normalized descriptors, rows of descs2 are noisy copies of descs1 so that there are true matches
+static void MakeDescriptors(int n1, int n2, int dim, float noise, cv::Mat &descs1, cv::Mat &descs2) {
+    cv::RNG rng(12345);
+    descs1.create(n1, dim, CV_32F);
+    descs2.create(n2, dim, CV_32F);
+    rng.fill(descs1, cv::RNG::NORMAL, 0.0, 1.0);
+    rng.fill(descs2, cv::RNG::NORMAL, 0.0, 1.0);
+    for (int i = 0; i < std::min(n1, n2) / 2; ++i) {
+        descs2.row(i) = descs1.row(i) + descs2.row(i) * noise;
+    }
+    for (int i = 0; i < n1; ++i) cv::normalize(descs1.row(i), descs1.row(i));
+    for (int i = 0; i < n2; ++i) cv::normalize(descs2.row(i), descs2.row(i));
+}
+
+
+// the original two-GEMM implementation, kept as the reference
+static void MatchReference(const cv::Mat &descs1, const cv::Mat &descs2, std::vector<cv::DMatch> &matches,
+                           float minScore) {
+    cv::Mat scores12 = descs1 * descs2.t();
+    cv::Mat scores21 = descs2 * descs1.t();
+    std::vector<int> match12(descs1.rows), match21(descs2.rows);
+    for (int i = 0; i < scores12.rows; i++) {
+        cv::Point maxLoc;
+        cv::minMaxLoc(scores12.row(i), nullptr, nullptr, nullptr, &maxLoc);
+        match12[i] = maxLoc.x;
+    }
+    for (int i = 0; i < scores21.rows; i++) {
+        cv::Point maxLoc;
+        cv::minMaxLoc(scores21.row(i), nullptr, nullptr, nullptr, &maxLoc);
+        match21[i] = maxLoc.x;
+    }
+    matches.clear();
+    for (int i = 0; i < descs1.rows; i++) {
+        int j = match12[i];
+        if (match21[j] == i && scores12.at<float>(i, j) > minScore) {
+            matches.emplace_back(i, j, scores12.at<float>(i, j));
+        }
+    }
+}
+
+
+// n correspondences of a known homography with 0.7 px noise, a fraction of them replaced by random outliers. Match
+// scores are drawn higher on average for the inliers, as with real descriptor matches.
+static void MakeCorrespondences(int n, double outlierRatio, const cv::Matx33d &H, MatchSet &matches,
+                                std::vector<uchar> &truth) {
+    cv::RNG rng(4321);
+    matches.Clear();
+    truth.assign(n, 0);
+    for (int i = 0; i < n; ++i) {
+        const cv::Point2f p(rng.uniform(0.f, 640.f), rng.uniform(0.f, 640.f));
+        cv::Point2f q(rng.uniform(0.f, 640.f), rng.uniform(0.f, 640.f));
+        float score = rng.uniform(0.82f, 0.95f);
+        if (rng.uniform(0.0, 1.0) >= outlierRatio) {
+            const cv::Vec3d x = H * cv::Vec3d(p.x, p.y, 1.0);
+            q = cv::Point2f((float)(x[0] / x[2] + rng.gaussian(0.7)), (float)(x[1] / x[2] + rng.gaussian(0.7)));
+            score = rng.uniform(0.85f, 1.f);
+            truth[i] = 1;
+        }
+        matches.queryIdx.push_back(i);
+        matches.trainIdx.push_back(i);
+        matches.scores.push_back(score);
+        matches.ptsQuery.push_back(p);
+        matches.ptsTrain.push_back(q);
+    }
+}
+
+
+// mean distance of the projected corners of a 640 x 640 image, in pixels
+static double CornerError(const cv::Mat &H, const cv::Matx33d &truthH) {
+    if (H.empty()) {
+        return std::numeric_limits<double>::infinity();
+    }
+    const std::vector<cv::Point2f> corners = {{0, 0}, {640, 0}, {640, 640}, {0, 640}};
+    std::vector<cv::Point2f> projected, expected;
+    cv::perspectiveTransform(corners, projected, H);
+    cv::perspectiveTransform(corners, expected, cv::Mat(truthH));
+    double error = 0;
+    for (size_t i = 0; i < corners.size(); ++i) {
+        error += cv::norm(projected[i] - expected[i]);
+    }
+    return error / (double)corners.size();
+}
+
+
+static int CountCommon(const std::vector<cv::DMatch> &a, const std::vector<cv::DMatch> &b) {
+    std::set<std::pair<int, int>> pairs;
+    for (const auto &m : b) pairs.insert({m.queryIdx, m.trainIdx});
+    int common = 0;
+    for (const auto &m : a) common += (int)pairs.count({m.queryIdx, m.trainIdx});
+    return common;
+}
+
+
+int main(int argc, char** argv) {
+    const std::string argKeys =
+            "{sizes | 1000,5000,20000 | comma separated descriptor counts}"
+            "{dim | 64 | descriptor dimension}"
+            "{minScore | 0.82 | minimum match score}"
+            "{reference | 1 | also run the reference implementation}"
+            "{hnsw | 1 | also run the HNSW index (recall vs latency)}"
+            "{ivfpq | 1 | also run the IVF-PQ index (recall vs memory)}"
+            "{scaling | 1 | report the thread scaling of Match}"
+            "{templates | 8 | number of templates matched against descs2 as a TemplateBank, 0 = skip}"
+            "{homography | 1000 | correspondences for the PROSAC vs USAC_MAGSAC homography comparison, 0 = skip}"
+            "{model | | XFeat model for the per-frame localization timing, empty = skip}"
+            "{fine | | optional re-acquisition model of CoarseToFineLocalizer}"
+            "{image | | full resolution grayscale scene of the localization timing}";
+    cv::CommandLineParser parser(argc, argv, argKeys);
+    const auto sizesStr = parser.get<std::string>("sizes");
+    const int dim = parser.get<int>("dim");
+    const auto minScore = parser.get<float>("minScore");
+    const bool runReference = parser.get<int>("reference") != 0;
+    const bool runHnsw = parser.get<int>("hnsw") != 0;
+    const bool runIvfPq = parser.get<int>("ivfpq") != 0;
+    const bool runScaling = parser.get<int>("scaling") != 0;
+    const int numTemplates = parser.get<int>("templates");
+    const int numCorrespondences = parser.get<int>("homography");
+    const auto modelFile = parser.get<std::string>("model");
+    const auto fineModelFile = parser.get<std::string>("fine");
+    const auto imageFile = parser.get<std::string>("image");
+
+    std::vector<int> sizes;
+    std::stringstream ss(sizesStr);
+    for (std::string item; std::getline(ss, item, ',');) {
+        sizes.push_back(std::stoi(item));
+    }
+
+    std::cout << std::fixed << std::setprecision(2);
+    for (int n : sizes) {
+        cv::Mat descs1, descs2;
+        MakeDescriptors(n, n, dim, 0.3f, descs1, descs2);
+        std::cout << "==== " << n << " x " << n << " (dim " << dim << ") ====" << std::endl;
+
+        Timer timer;
+        std::vector<cv::DMatch> matches;
+        Matcher::Match(descs1, descs2, matches, minScore);
+        const double matchTime = timer.Elapse();
+        std::cout << "Match:     " << matchTime * 1e3 << " ms, " << matches.size() << " matches" << std::endl;
+
+        if (runScaling) {
+            // 1, 2, 4, ... threads up to the number of cores, efficiency = t1 / (threads * tN)
+            const int numThreads = cv::getNumThreads();
+            double time1 = 0;
+            for (int threads = 1;; threads = std::min(threads * 2, cv::getNumberOfCPUs())) {
+                cv::setNumThreads(threads);
+                timer.Reset();
+                std::vector<cv::DMatch> threadMatches;
+                Matcher::Match(descs1, descs2, threadMatches, minScore);
+                const double t = timer.Elapse();
+                if (threads == 1) {
+                    time1 = t;
+                }
+                const bool identical = threadMatches.size() == matches.size() &&
+                                       CountCommon(threadMatches, matches) == (int)matches.size();
+                std::cout << "Threads " << std::setw(2) << threads << ": " << t * 1e3 << " ms, speedup "
+                          << time1 / t << "x, efficiency " << 100.0 * time1 / (threads * t) << "%"
+                          << (identical ? "" : ", RESULTS DIFFER") << std::endl;
+                if (threads >= cv::getNumberOfCPUs()) {
+                    break;
+                }
+            }
+            cv::setNumThreads(numThreads);
+        }
+
+        // descs1 packed once, as for a template matched against every frame
+        PreparedDescriptors prepared1(descs1);
+        timer.Reset();
+        std::vector<cv::DMatch> preparedMatches;
+        Matcher::Match(prepared1, descs2, preparedMatches, minScore);
+        std::cout << "Prepared:  " << timer.Elapse() * 1e3 << " ms, " << preparedMatches.size() << " matches, "
+                  << CountCommon(preparedMatches, matches) << " identical" << std::endl;
+
+        // fp16 storage, converted on the fly and accumulated in fp32
+        cv::Mat hdescs1, hdescs2;
+        descs1.convertTo(hdescs1, CV_16F);
+        descs2.convertTo(hdescs2, CV_16F);
+        timer.Reset();
+        std::vector<cv::DMatch> fp16Matches;
+        Matcher::Match(hdescs1, hdescs2, fp16Matches, minScore);
+        std::cout << "FP16:      " << timer.Elapse() * 1e3 << " ms, " << fp16Matches.size() << " matches, "
+                  << CountCommon(fp16Matches, matches) << " identical" << std::endl;
+
+        // int8 codes, 4x smaller than the float descriptors
+        cv::Mat qdescs1, qdescs2;
+        Matcher::QuantizeDescriptors(descs1, qdescs1);
+        Matcher::QuantizeDescriptors(descs2, qdescs2);
+        timer.Reset();
+        std::vector<cv::DMatch> int8Matches;
+        Matcher::Match(qdescs1, qdescs2, int8Matches, minScore);
+        std::cout << "Int8:      " << timer.Elapse() * 1e3 << " ms, " << int8Matches.size() << " matches, "
+                  << CountCommon(int8Matches, matches) << " identical" << std::endl;
+
+        // sign-hash prefilter, recall measured against the exact matcher
+        timer.Reset();
+        std::vector<cv::DMatch> hashedMatches;
+        Matcher::MatchHashed(descs1, descs2, hashedMatches, minScore);
+        const int hashedCommon = CountCommon(hashedMatches, matches);
+        std::cout << "Hashed:    " << timer.Elapse() * 1e3 << " ms, " << hashedMatches.size() << " matches, recall "
+                  << 100.0 * hashedCommon / std::max<size_t>(matches.size(), 1) << "%" << std::endl;
+
+        // a few queries against the whole set, as for a single-keypoint lookup
+        {
+            cv::Mat fewDescs1, fewDescs2;
+            MakeDescriptors(16, n, dim, 0.3f, fewDescs1, fewDescs2);
+            std::vector<cv::DMatch> exactMatches, fewMatches;
+            Matcher::Match(fewDescs1, fewDescs2, exactMatches, minScore);
+            timer.Reset();
+            Matcher::MatchHashed(fewDescs1, fewDescs2, fewMatches, minScore);
+            std::cout << "Hashed 16 x " << n << ": " << timer.Elapse() * 1e3 << " ms, " << fewMatches.size()
+                      << " matches, recall "
+                      << 100.0 * CountCommon(fewMatches, exactMatches) / std::max<size_t>(exactMatches.size(), 1)
+                      << "%" << std::endl;
+        }
+
+        if (numTemplates > 0) {
+            // descs1 split into templates, matched against descs2 one by one and as one stacked bank
+            TemplateBank bank;
+            std::vector<PreparedDescriptors> separate;
+            for (int t = 0; t < numTemplates; ++t) {
+                const int r0 = n * t / numTemplates, r1 = n * (t + 1) / numTemplates;
+                bank.Add(std::vector<cv::KeyPoint>(r1 - r0), descs1.rowRange(r0, r1));
+                separate.emplace_back(descs1.rowRange(r0, r1));
+            }
+            timer.Reset();
+            size_t separateCount = 0;
+            for (const auto &prepared : separate) {
+                std::vector<cv::DMatch> templateMatches;
+                Matcher::Match(prepared, descs2, templateMatches, minScore);
+                separateCount += templateMatches.size();
+            }
+            const double separateTime = timer.Elapse();
+            timer.Reset();
+            std::vector<std::vector<cv::DMatch>> bankMatches;
+            bank.Match(descs2, bankMatches, minScore);
+            const double bankTime = timer.Elapse();
+            size_t bankCount = 0;
+            for (const auto &m : bankMatches) bankCount += m.size();
+            std::cout << "Templates: " << numTemplates << " separate " << separateTime * 1e3 << " ms ("
+                      << separateCount << " matches), bank " << bankTime * 1e3 << " ms (" << bankCount
+                      << " matches)" << std::endl;
+        }
+
+        if (runHnsw) {
+            // descs2 as the reference store, recall measured against the exact matcher
+            timer.Reset();
+            HnswIndex index(dim);
+            index.Add(descs2);
+            std::cout << "HNSW build: " << timer.Elapse() * 1e3 << " ms" << std::endl;
+            for (int ef : {16, 32, 64, 128}) {
+                index.SetEf(ef);
+                timer.Reset();
+                std::vector<cv::DMatch> hnswMatches;
+                index.Match(descs1, hnswMatches, minScore);
+                const int hnswCommon = CountCommon(hnswMatches, matches);
+                std::cout << "HNSW ef " << std::setw(3) << ef << ": " << timer.Elapse() * 1e3 << " ms, recall "
+                          << 100.0 * hnswCommon / std::max<size_t>(matches.size(), 1) << "%" << std::endl;
+            }
+        }
+
+        if (runIvfPq) {
+            // 8 and 16 byte codes, PQ scores only and with exact re-ranking of the best 32 candidates
+            const int nlist = std::max(16, (int)std::sqrt((double)n));
+            for (int m : {8, 16}) {
+                for (bool keepVectors : {false, true}) {
+                    IvfPqIndex index(dim, nlist, m, keepVectors);
+                    timer.Reset();
+                    if (!index.Train(descs2)) {
+                        break;
+                    }
+                    index.Add(descs2);
+                    const double buildTime = timer.Elapse();
+                    timer.Reset();
+                    std::vector<cv::DMatch> ivfMatches;
+                    index.Match(descs1, ivfMatches, keepVectors ? minScore : 0.f);
+                    const int ivfCommon = CountCommon(ivfMatches, matches);
+                    std::cout << "IVF-PQ " << std::setw(2) << m << "B" << (keepVectors ? " rerank" : "       ")
+                              << ": " << timer.Elapse() * 1e3 << " ms (build " << buildTime * 1e3 << " ms), "
+                              << (double)index.MemoryUsage() / index.Size() << " bytes/desc, recall "
+                              << 100.0 * ivfCommon / std::max<size_t>(matches.size(), 1) << "%" << std::endl;
+                }
+            }
+        }
+
+        if (runReference) {
+            timer.Reset();
+            std::vector<cv::DMatch> refMatches;
+            MatchReference(descs1, descs2, refMatches, minScore);
+            const double refTime = timer.Elapse();
+            std::cout << "Reference: " << refTime * 1e3 << " ms, " << refMatches.size() << " matches, "
+                      << CountCommon(matches, refMatches) << " identical, speedup " << refTime / matchTime
+                      << "x" << std::endl;
+        }
+    }
+
+    if (numCorrespondences > 0) {
+        // time, recall of the true inliers and corner error, averaged over repeated runs
+        const cv::Matx33d truthH(1.1, 0.05, 30, -0.03, 0.95, 12, 2e-4, -1e-4, 1);
+        const int runs = 20;
+        std::cout << "==== homography, " << numCorrespondences << " correspondences ====" << std::endl;
+        for (double outlierRatio : {0.3, 0.5, 0.7, 0.85}) {
+            MatchSet matches;
+            std::vector<uchar> truth;
+            MakeCorrespondences(numCorrespondences, outlierRatio, truthH, matches, truth);
+            const int truthCount = cv::countNonZero(truth);
+            for (int method = 0; method < 3; ++method) {
+                // 0: PROSAC/SPRT, 1: USAC_MAGSAC, 2: pose voting prefilter then USAC_MAGSAC
+                cv::Mat H;
+                std::vector<uchar> inliers;
+                MatchSet filtered;
+                double voteTime = 0;
+                Timer timer;
+                for (int r = 0; r < runs; ++r) {
+                    if (method == 0) {
+                        H = Geometry::FindHomography(matches, inliers, 4.0, 0.995, 700);
+                    } else if (method == 1) {
+                        H = cv::findHomography(matches.ptsQuery, matches.ptsTrain, cv::USAC_MAGSAC, 4.0, inliers,
+                                               700, 0.995);
+                    } else {
+                        Timer voteTimer;
+                        filtered = matches;
+                        Matcher::voteFilterMatches(filtered, cv::Point2f(320, 320));
+                        voteTime += voteTimer.Elapse();
+                        if (filtered.Size() < 4) {
+                            H.release();
+                            inliers.clear();
+                        } else {
+                            H = cv::findHomography(filtered.ptsQuery, filtered.ptsTrain, cv::USAC_MAGSAC, 4.0,
+                                                   inliers, 700, 0.995);
+                        }
+                    }
+                }
+                const double t = timer.Elapse() / runs;
+                const MatchSet &fitted = method == 2 ? filtered : matches;
+                int found = 0;
+                for (size_t i = 0; i < inliers.size() && i < (size_t)fitted.Size(); ++i) {
+                    found += truth[fitted.queryIdx[i]] && inliers[i];
+                }
+                static const char *names[] = {"PROSAC/SPRT: ", "USAC_MAGSAC: ", "vote + MAGSAC: "};
+                std::cout << "Outliers " << std::setw(3) << (int)(outlierRatio * 100) << "% " << names[method]
+                          << t * 1e3 << " ms";
+                if (method == 2) {
+                    std::cout << " (vote " << voteTime / runs * 1e3 << " ms, kept " << filtered.Size() << ")";
+                }
+                std::cout << ", inliers " << cv::countNonZero(inliers) << ", recall "
+                          << 100.0 * found / std::max(truthCount, 1) << "%, corner error " << CornerError(H, truthH)
+                          << " px" << std::endl;
+            }
+        }
+
+        // 8 candidate sets, e.g. templates, verified one after another vs concurrently with and without a winner
+        std::vector<MatchSet> sets(8);
+        for (int k = 0; k < (int)sets.size(); ++k) {
+            std::vector<uchar> truth;
+            MakeCorrespondences(numCorrespondences, 0.5 + 0.05 * k, truthH, sets[k], truth);
+        }
+        std::vector<Geometry::Verification> results;
+        Timer timer;
+        for (int r = 0; r < runs; ++r) {
+            for (const auto &set : sets) {
+                std::vector<uchar> inliers;
+                Geometry::FindHomography(set, inliers, 4.0, 0.995, 700);
+            }
+        }
+        std::cout << "Batch of " << sets.size() << " sets: sequential " << timer.Elapse() / runs * 1e3 << " ms";
+        for (int stopInliers : {0, numCorrespondences / 4}) {
+            timer.Reset();
+            int best = -1;
+            for (int r = 0; r < runs; ++r) {
+                best = Geometry::VerifyBatch(sets, results, Geometry::Model::Homography, stopInliers);
+            }
+            int cancelled = 0;
+            for (const auto &result : results) {
+                cancelled += result.cancelled;
+            }
+            std::cout << ", VerifyBatch(stopInliers " << stopInliers << ") " << timer.Elapse() / runs * 1e3
+                      << " ms, best " << best << ", cancelled " << cancelled;
+        }
+        std::cout << std::endl;
+    }
+
+    if (!modelFile.empty() && !imageFile.empty()) {
+        const cv::Mat scene = cv::imread(imageFile, cv::IMREAD_GRAYSCALE);
+        if (scene.empty()) {
+            std::cerr << "Cannot read " << imageFile << std::endl;
+            return -1;
+        }
+        // the central third of the scene is the template, resized to 640 x 640 as in MatchRefine. The frames are
+        // the scene shifted by 2 px per frame.
+        const cv::Rect templRect(scene.cols / 3, scene.rows / 3, scene.cols / 3, scene.rows / 3);
+        cv::Mat templ;
+        cv::resize(scene(templRect), templ, cv::Size(640, 640), 0, 0, cv::INTER_AREA);
+        const int numFrames = 60;
+        std::vector<cv::Mat> frames(numFrames);
+        std::vector<cv::Matx33d> truths(numFrames);
+        for (int f = 0; f < numFrames; ++f) {
+            const double dx = 2.0 * f;
+            cv::warpAffine(scene, frames[f], cv::Matx23d(1, 0, dx, 0, 1, 0), scene.size());
+            truths[f] = cv::Matx33d(templRect.width / 640.0, 0, templRect.x + dx,
+                                    0, templRect.height / 640.0, templRect.y, 0, 0, 1);
+        }
+
+        XFeat xfeat(modelFile);
+        std::unique_ptr<XFeat> fineXFeat;
+        if (!fineModelFile.empty()) {
+            fineXFeat = std::make_unique<XFeat>(fineModelFile);
+        }
+        std::cout << "==== localization, " << scene.cols << " x " << scene.rows << ", " << numFrames
+                  << " frames ====" << std::endl;
+
+        // plain: the whole frame downscaled to 640 x 640, as the MatchRefine live loop without --track
+        std::vector<cv::KeyPoint> keysT, keysF;
+        cv::Mat descsT, descsF, small;
+        xfeat.DetectAndCompute(templ, keysT, descsT, 1000);
+        PreparedDescriptors preparedT(descsT);
+        const cv::Matx33d toFrame(scene.cols / 640.0, 0, 0, 0, scene.rows / 640.0, 0, 0, 0, 1);
+        double error = 0;
+        int found = 0;
+        Timer timer;
+        for (int f = 0; f < numFrames; ++f) {
+            cv::resize(frames[f], small, cv::Size(640, 640));
+            xfeat.DetectAndCompute(small, keysF, descsF, 1000);
+            MatchSet matches;
+            Matcher::Match(preparedT, descsF, keysT, keysF, matches, 0.82f);
+            std::vector<uchar> inliers;
+            const cv::Mat H = matches.Size() >= 4 ? Geometry::FindHomography(matches, inliers, 4.0) : cv::Mat();
+            if (!H.empty()) {
+                error += CornerError(cv::Mat(toFrame) * H, truths[f]);
+                ++found;
+            }
+        }
+        std::cout << "Plain --model: " << timer.Elapse() / numFrames * 1e3 << " ms/frame, found " << found
+                  << ", corner error " << error / std::max(found, 1) << " px" << std::endl;
+
+        // tracked: CoarseToFineLocalizer, the whole frame is only seen when the track is lost
+        CoarseToFineLocalizer localizer(xfeat, fineXFeat.get());
+        localizer.SetTemplate(templ);
+        double reacquireTime = 0, trackTime = 0;
+        int reacquired = 0, tracked = 0;
+        error = 0;
+        found = 0;
+        for (int f = 0; f < numFrames; ++f) {
+            CoarseToFineLocalizer::Result result;
+            timer.Reset();
+            const bool ok = localizer.Locate(frames[f], result);
+            const double t = timer.Elapse();
+            if (result.coarse) {
+                reacquireTime += t;
+                ++reacquired;
+            } else {
+                trackTime += t;
+                ++tracked;
+            }
+            if (ok) {
+                error += CornerError(result.H, truths[f]);
+                ++found;
+            }
+        }
+        std::cout << "Localizer:     " << (reacquireTime + trackTime) / numFrames * 1e3 << " ms/frame ("
+                  << tracked << " tracked " << trackTime / std::max(tracked, 1) * 1e3 << " ms, " << reacquired
+                  << " re-acquired " << reacquireTime / std::max(reacquired, 1) * 1e3 << " ms), found " << found
+                  << ", corner error " << error / std::max(found, 1) << " px" << std::endl;
+    }
+
+    return 0;
+}
@@ -6,6 +6,7 @@
 #include "OnnxHelper.h"
 #include "XFeat.h"
 #include "Matcher.h"
+#include "Geometry.h"
 #include "camera_opt/include/OptCamera.h"
 
 
@@ -14,6 +15,9 @@ int main(int argc, char** argv) {
     std::string imgFile1  = ""; // no default: template must be provided via --img1 or captured from camera
     std::string imgFile2  = ""; // no default
     int useRansac = 1;
+    float maxRatio = 1.0f; // Lowe ratio test, 1 = disabled
+    float guidedRadius = 0.0f; // live mode: search radius around the previous homography, 0 = disabled
+    std::string geometry = ""; // live mode: similarity, affine, homography or auto, empty = F rejection + RANSAC H
 
     // 手动解析命令行参数
     for (int i = 1; i < argc; ++i) {
@@ -26,10 +30,18 @@ int main(int argc, char** argv) {
             imgFile2 = argv[++i];
         } else if (arg == "--ransac" && i + 1 < argc) {
             useRansac = std::stoi(argv[++i]);
+        } else if (arg == "--ratio" && i + 1 < argc) {
+            maxRatio = std::stof(argv[++i]);
+        } else if (arg == "--guided" && i + 1 < argc) {
+            guidedRadius = std::stof(argv[++i]);
+        } else if (arg == "--geometry" && i + 1 < argc) {
+            geometry = argv[++i];
         } else if (arg == "--help") {
-            std::cout << "Usage: --model <model> --img1 <img1> [--img2 <img2>] --ransac <0|1>\n";
+            std::cout << "Usage: --model <model> --img1 <img1> [--img2 <img2>] --ransac <0|1> [--ratio <0..1>] [--guided <radius>]"
+                         " [--geometry <similarity|affine|homography|auto>]\n";
             std::cout << "  If both --img1 and --img2 are set: static image matching mode\n";
             std::cout << "  Otherwise: live stream matching mode (requires camera)\n";
+            std::cout << "  --geometry fits the given model to the live matches, auto escalates from similarity\n";
             return 0;
         }
     }
@@ -38,6 +50,17 @@ int main(int argc, char** argv) {
     std::cout << "Image file 1: " << (imgFile1.empty() ? "(none - will capture from camera)" : imgFile1) << std::endl;
     std::cout << "Image file 2: " << (imgFile2.empty() ? "(none - will use live stream)" : imgFile2) << std::endl;
     std::cout << "Use RANSAC: " << (useRansac ? "true" : "false") << std::endl;
+    std::cout << "Ratio test: " << maxRatio << std::endl;
+    std::cout << "Guided radius: " << guidedRadius << std::endl;
+
+    Geometry::Model geoModel = Geometry::Model::Homography;
+    const bool escalate = geometry == "auto";
+    if (!geometry.empty() && !escalate &&
+        (!Geometry::ParseModel(geometry, geoModel) || geoModel == Geometry::Model::Fundamental)) {
+        std::cerr << "Unknown geometry " << geometry << ", use similarity, affine, homography or auto" << std::endl;
+        return -1;
+    }
+    std::cout << "Geometry: " << (geometry.empty() ? "F rejection + RANSAC homography" : geometry) << std::endl;
 
     // Determine mode: static image matching vs. live stream matching
     bool staticMode = !imgFile1.empty() && !imgFile2.empty();
@@ -173,7 +196,7 @@ int main(int argc, char** argv) {
 
         std::cout << "Matching features: template(" << keysT.size() << ") vs image2(" << keysF.size() << ")" << std::endl;
         std::vector<cv::DMatch> matches;
-        Matcher::Match(descsT, descsF, matches, 0.88f);
+        Matcher::Match(descsT, descsF, matches, 0.88f, maxRatio);
 
         if (useRansac && !matches.empty()) {
             std::vector<cv::Point2f> ptsT, ptsF;
@@ -244,13 +267,20 @@ int main(int argc, char** argv) {
     std::cout << "Press ESC to exit" << std::endl;
     std::cout << "===================================================\n" << std::endl;
 
+    // template descriptors are packed once and reused for every frame until the template is reselected
+    PreparedDescriptors preparedT(descsT);
+    // homography of the previous frame while tracking is stable, guides the matching of the next frame
+    cv::Mat prevH;
+
     // for FPS calculation
     double fps = 0.0;
     auto last_ts = std::chrono::high_resolution_clock::now();
     int frameCount = 0;
     
     while (true) {
-        cv::Mat frame = camera.captureImage(1000);
+        // the frame stays in its SDK buffer, released at the end of the iteration
+        const OptCamera::Frame grabbed = camera.grabFrame(1000);
+        const cv::Mat &frame = grabbed.mat();
         if (frame.empty()) {
             int kk = cv::waitKey(1);
             if (kk == 27) break; // ESC
@@ -277,17 +307,20 @@ int main(int argc, char** argv) {
         cv::Mat descsF;
         xfeat.DetectAndCompute(gray, keysF, descsF, 1000);
 
+        // matched points are gathered once, DMatch is only built for drawing
         std::vector<cv::DMatch> matches;
+        MatchSet matchSet;
         if (!keysF.empty() && !descsF.empty()) {
-            Matcher::Match(descsT, descsF, matches, 0.82f);
-            if (useRansac && !matches.empty()) {
-                std::vector<cv::Point2f> ptsT, ptsF;
-                for (auto &m : matches) {
-                    ptsT.push_back(keysT[m.queryIdx].pt);
-                    ptsF.push_back(keysF[m.trainIdx].pt);
-                }
-                Matcher::RejectBadMatchesF(ptsT, ptsF, matches, 4.0f);
+            if (guidedRadius > 0 && !prevH.empty()) {
+                Matcher::MatchGuided(keysT, descsT, keysF, descsF, prevH, guidedRadius, matches, 0.82f, maxRatio);
+                matchSet.Assign(matches, keysT, keysF);
+            } else {
+                Matcher::Match(preparedT, descsF, keysT, keysF, matchSet, 0.82f, maxRatio);
             }
+            if (useRansac && geometry.empty()) {
+                Matcher::RejectBadMatchesF(matchSet, 4.0f);
+            }
+            matchSet.ToDMatches(matches);
         }
 
         // draw matches (template left, frame right)
@@ -299,19 +332,42 @@ int main(int argc, char** argv) {
 
         // compute homography from template to frame if possible
         double homography_conf = 0.0;
-        int matchCount = (int)matches.size();
-        if (matches.size() >= 4) {
-            std::vector<cv::Point2f> ptsT, ptsF;
-            for (auto &m : matches) {
-                ptsT.push_back(keysT[m.queryIdx].pt);
-                ptsF.push_back(keysF[m.trainIdx].pt);
+        int matchCount = matchSet.Size();
+        prevH.release();
+        if (matchCount >= 4) {
+            std::vector<uchar> inlierMask;
+            cv::Mat H;
+            if (escalate) {
+                // the cheapest model that explains the matches, the result is already refined on its inliers
+                H = Geometry::FitEscalating(matchSet, geoModel, inlierMask);
+            } else if (!geometry.empty()) {
+                H = Geometry::Fit(geoModel, matchSet, inlierMask);
+            } else {
+                H = cv::findHomography(matchSet.ptsQuery, matchSet.ptsTrain, cv::RANSAC, 4.0, inlierMask);
             }
-            cv::Mat inlierMask;
-            cv::Mat H = cv::findHomography(ptsT, ptsF, cv::RANSAC, 4.0, inlierMask);
             if (!H.empty() && !inlierMask.empty()) {
                 int inliers = cv::countNonZero(inlierMask);
                 homography_conf = matchCount > 0 ? (double)inliers / (double)matchCount : 0.0;
 
+                // least-squares refinement on the inliers, a few microseconds per frame. Geometry already refines
+                // its models.
+                if (geometry.empty()) {
+                    std::vector<cv::Point2f> inT, inF;
+                    for (size_t i = 0; i < inlierMask.size(); ++i) {
+                        if (inlierMask[i]) {
+                            inT.push_back(matchSet.ptsQuery[i]);
+                            inF.push_back(matchSet.ptsTrain[i]);
+                        }
+                    }
+                    if (inT.size() >= 8) {
+                        Matcher::refineHomography(H, inT, inF);
+                    }
+                }
+
+                if (inliers >= 15 && homography_conf >= 0.5) {
+                    prevH = H;
+                }
+
                 // draw warped template corners on frame
                 std::vector<cv::Point2f> cornersT = {
                     {0, 0},
@@ -339,6 +395,9 @@ int main(int argc, char** argv) {
         oss << std::setprecision(1) << "FPS:" << fps;
         oss << "  matches:" << matchCount;
         oss << std::setprecision(2) << "  H_conf:" << homography_conf;
+        if (!geometry.empty()) {
+            oss << "  model:" << Geometry::ModelName(geoModel);
+        }
         cv::putText(imgMatches, oss.str(), cv::Point(10, 20),
                    cv::FONT_HERSHEY_SIMPLEX, 0.6, cv::Scalar(0, 255, 255), 2);
 
@@ -354,6 +413,8 @@ int main(int argc, char** argv) {
                 templateImg = gray(roi).clone();
                 cv::resize(templateImg, templateImg, cv::Size(640, 640));
                 xfeat.DetectAndCompute(templateImg, keysT, descsT, 1000);
+                preparedT.Prepare(descsT);
+                prevH.release();
                 std::cout << "New template set with " << keysT.size() << " features.\n" << std::endl;
             } else {
                 std::cout << "ROI selection cancelled. Continuing with previous template.\n" << std::endl;
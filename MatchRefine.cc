@@ -6,14 +6,42 @@
 #include "OnnxHelper.h"
 #include "XFeat.h"
 #include "Matcher.h"
+#include "Geometry.h"
+#include "HomographyTracker.h"
+#include "CoarseToFineLocalizer.h"
 #include "camera_opt/include/OptCamera.h"
 
 
+// template outline warped by H (template -> frame), the frame being drawn offsetX pixels right of the template
+static void DrawTemplateOutline(cv::Mat &img, const cv::Size &templSize, const cv::Mat &H, int offsetX) {
+    std::vector<cv::Point2f> cornersT = {
+        {0, 0},
+        {(float)templSize.width, 0},
+        {(float)templSize.width, (float)templSize.height},
+        {0, (float)templSize.height}
+    };
+    std::vector<cv::Point2f> cornersF;
+    cv::perspectiveTransform(cornersT, cornersF, H);
+
+    std::vector<cv::Point> poly;
+    for (auto &p : cornersF) {
+        poly.push_back(cv::Point((int)std::round(p.x) + offsetX, (int)std::round(p.y)));
+    }
+    const cv::Point* pts = poly.data();
+    int npts = (int)poly.size();
+    cv::polylines(img, &pts, &npts, 1, true, cv::Scalar(0, 255, 0), 2);
+}
+
+
 int main(int argc, char** argv) {
     std::string modelFile = "../../model/xfeat_640x640.onnx";
     std::string imgFile1  = ""; // no default: template must be provided via --img1 or captured from camera
     std::string imgFile2  = ""; // no default
     int useRansac = 1;
+    int useMagsac = 0;
+    int useTrack = 0;           // localizes the template on full resolution crops in live mode
+    std::string fineModelFile;  // optional re-acquisition model of the localizer, implies --track 1
+    int useVote = 0;
 
     // 手动解析命令行参数
     for (int i = 1; i < argc; ++i) {
@@ -26,10 +54,24 @@ int main(int argc, char** argv) {
             imgFile2 = argv[++i];
         } else if (arg == "--ransac" && i + 1 < argc) {
             useRansac = std::stoi(argv[++i]);
+        } else if (arg == "--magsac" && i + 1 < argc) {
+            useMagsac = std::stoi(argv[++i]);
+        } else if (arg == "--track" && i + 1 < argc) {
+            useTrack = std::stoi(argv[++i]);
+        } else if (arg == "--fine" && i + 1 < argc) {
+            fineModelFile = argv[++i];
+        } else if (arg == "--vote" && i + 1 < argc) {
+            useVote = std::stoi(argv[++i]);
         } else if (arg == "--help") {
-            std::cout << "Usage: --model <model> --img1 <img1> [--img2 <img2>] --ransac <0|1>\n";
+            std::cout << "Usage: --model <model> --img1 <img1> [--img2 <img2>] --ransac <0|1> [--magsac <0|1>]"
+                         " [--track <0|1>] [--fine <model>] [--vote <0|1>]\n";
             std::cout << "  If both --img1 and --img2 are set: static image matching mode\n";
             std::cout << "  Otherwise: live stream matching mode (requires camera)\n";
+            std::cout << "  --magsac 1 estimates the live homography with cv::USAC_MAGSAC instead of PROSAC/SPRT\n";
+            std::cout << "  --track 1 runs --model on a full resolution crop around the tracked template, and on the\n";
+            std::cout << "    whole frame only to re-acquire it\n";
+            std::cout << "  --fine <model> refines re-acquired frames with a second model (e.g. xfeat_800x576.onnx)\n";
+            std::cout << "  --vote 1 keeps the live matches agreeing on the template pose before the homography\n";
             return 0;
         }
     }
@@ -254,13 +296,33 @@ int main(int argc, char** argv) {
     std::cout << "Press ESC to exit" << std::endl;
     std::cout << "===================================================\n" << std::endl;
 
+    // template descriptors are packed once and reused for every frame until the template is reselected
+    PreparedDescriptors preparedT(descsT);
+
+    // tracking mode: --model sees a full resolution crop around the template, the whole frame only to re-acquire it
+    std::unique_ptr<XFeat> fineXFeat;
+    std::unique_ptr<CoarseToFineLocalizer> localizer;
+    if (useTrack || !fineModelFile.empty()) {
+        if (!fineModelFile.empty()) {
+            fineXFeat = std::make_unique<XFeat>(fineModelFile);
+        }
+        localizer = std::make_unique<CoarseToFineLocalizer>(xfeat, fineXFeat.get());
+        if (!localizer->SetTemplate(templateImg)) {
+            return -1;
+        }
+    }
+
     // for FPS calculation
     double fps = 0.0;
     auto last_ts = std::chrono::high_resolution_clock::now();
     int frameCount = 0;
     
+    // the previous frame's homography is tried before the robust search
+    HomographyTracker tracker(4.0);
     while (true) {
-        cv::Mat frame = camera.captureImage(1000);
+        // the frame stays in its SDK buffer, released at the end of the iteration
+        const OptCamera::Frame grabbed = camera.grabFrame(1000);
+        const cv::Mat &frame = grabbed.mat();
         if (frame.empty()) {
             int kk = cv::waitKey(1);
             if (kk == 27) break; // ESC
@@ -280,18 +342,27 @@ int main(int argc, char** argv) {
         cv::Mat gray;
         if (frame.channels() == 3) cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
         else gray = frame;
+        const cv::Mat grayFull = gray;  // resize below allocates a new buffer for gray
         cv::resize(gray, gray, cv::Size(640, 640));
 
-        // detect features on live frame
+        // detect features on live frame, the localizer runs its own detection
         std::vector<cv::KeyPoint> keysF;
         cv::Mat descsF;
-        xfeat.DetectAndCompute(gray, keysF, descsF, 1000);
+        if (!localizer) {
+            xfeat.DetectAndCompute(gray, keysF, descsF, 1000);
+        }
 
+        // matched points are gathered once, DMatch is only built for drawing
         std::vector<cv::DMatch> matches;
+        MatchSet matchSet;
         if (!keysF.empty() && !descsF.empty()) {
-            Matcher::Match(descsT, descsF, matches, 0.82f);
-            Matcher::gridFilterMatches(keysF, matches,
-                  gray.cols, gray.rows);
+            Matcher::Match(preparedT, descsF, keysT, keysF, matchSet, 0.82f);
+            if (useVote) {
+                const cv::Point2f center(templateImg.cols * 0.5f, templateImg.rows * 0.5f);
+                Matcher::voteFilterMatches(matchSet, center);
+            }
+            Matcher::gridFilterMatches(matchSet, gray.cols, gray.rows);
+            matchSet.ToDMatches(matches);
         }
 
         // draw matches (template left, frame right)
@@ -303,48 +374,46 @@ int main(int argc, char** argv) {
 
         // compute homography from template to frame if possible
         double homography_conf = 0.0;
-        int matchCount = (int)matches.size();
-        if (matches.size() >= 4) {
-            std::vector<cv::Point2f> ptsT, ptsF;
-            for (auto &m : matches) {
-                ptsT.push_back(keysT[m.queryIdx].pt);
-                ptsF.push_back(keysF[m.trainIdx].pt);
+        int matchCount = matchSet.Size();
+        CoarseToFineLocalizer::Result located;
+        if (localizer) {
+            if (localizer->Locate(grayFull, located)) {
+                // full resolution frame -> displayed 640 x 640 frame
+                const cv::Matx33d toDisplay(640.0 / grayFull.cols, 0, 0, 0, 640.0 / grayFull.rows, 0, 0, 0, 1);
+                const cv::Mat H = cv::Mat(toDisplay) * located.H;
+                matchCount = located.matches;
+                homography_conf = matchCount > 0 ? (double)located.inliers / (double)matchCount : 0.0;
+                DrawTemplateOutline(imgMatches, templateImg.size(), H, templColor.cols);
+            }
+        } else if (matchCount >= 4) {
+            const std::vector<cv::Point2f> &ptsT = matchSet.ptsQuery, &ptsF = matchSet.ptsTrain;
+            std::vector<uchar> inlierMask;
+            cv::Mat H;
+            if (useMagsac) {
+                H = cv::findHomography(ptsT, ptsF, cv::USAC_MAGSAC, 4.0, inlierMask, 700, 0.995);
+            } else {
+                // warm start from the previous frame, score-ordered sampling when it no longer fits
+                H = tracker.Update(matchSet, inlierMask);
             }
-            cv::Mat inlierMask;
-            cv::Mat H = cv::findHomography(ptsT, ptsF, cv::USAC_MAGSAC, 4.0, inlierMask, 700, 0.995);
             if (!H.empty() && !inlierMask.empty()) {
                 int inliers = cv::countNonZero(inlierMask);
                 homography_conf = matchCount > 0 ? (double)inliers / (double)matchCount : 0.0;
 
                 /* ---------- non-linear refinement ---------- */
-                std::vector<cv::Point2f> inT, inF;
-                for (int i = 0; i < inlierMask.rows; ++i)
-                    if (inlierMask.at<uchar>(i)) {
-                        inT.push_back(ptsT[i]);
-                        inF.push_back(ptsF[i]);
-                    }
-
-                if (inT.size() >= 8)
-                    Matcher::refineHomography(H, inT, inF);
+                if (useMagsac) {
+                    std::vector<cv::Point2f> inT, inF;
+                    for (size_t i = 0; i < inlierMask.size(); ++i)
+                        if (inlierMask[i]) {
+                            inT.push_back(ptsT[i]);
+                            inF.push_back(ptsF[i]);
+                        }
+
+                    if (inT.size() >= 8)
+                        Matcher::refineHomography(H, inT, inF);
+                }
 
                 // draw warped template corners on frame
-                std::vector<cv::Point2f> cornersT = {
-                    {0, 0},
-                    {(float)templateImg.cols, 0},
-                    {(float)templateImg.cols, (float)templateImg.rows},
-                    {0, (float)templateImg.rows}
-                };
-                std::vector<cv::Point2f> cornersF;
-                cv::perspectiveTransform(cornersT, cornersF, H);
-
-                int offsetX = templColor.cols;
-                std::vector<cv::Point> poly;
-                for (auto &p : cornersF) {
-                    poly.push_back(cv::Point((int)std::round(p.x) + offsetX, (int)std::round(p.y)));
-                }
-                const cv::Point* pts = poly.data();
-                int npts = (int)poly.size();
-                cv::polylines(imgMatches, &pts, &npts, 1, true, cv::Scalar(0, 255, 0), 2);
+                DrawTemplateOutline(imgMatches, templateImg.size(), H, templColor.cols);
             }
         }
 
@@ -354,6 +423,12 @@ int main(int argc, char** argv) {
         oss << std::setprecision(1) << "FPS:" << fps;
         oss << "  matches:" << matchCount;
         oss << std::setprecision(2) << "  H_conf:" << homography_conf;
+        if (localizer) {
+            oss << (located.coarse ? "  reacquire" : "  track") << std::setprecision(1) << "  ms:"
+                << (located.coarseSeconds + located.fineSeconds) * 1e3;
+        } else if (!useMagsac) {
+            oss << (tracker.LastWarm() ? "  warm" : "  full");
+        }
         cv::putText(imgMatches, oss.str(), cv::Point(10, 20),
                    cv::FONT_HERSHEY_SIMPLEX, 0.6, cv::Scalar(0, 255, 255), 2);
 
@@ -369,6 +444,11 @@ int main(int argc, char** argv) {
                 templateImg = gray(roi).clone();
                 cv::resize(templateImg, templateImg, cv::Size(640, 640));
                 xfeat.DetectAndCompute(templateImg, keysT, descsT, 1000);
+                preparedT.Prepare(descsT);
+                tracker.Reset();
+                if (localizer) {
+                    localizer->SetTemplate(templateImg);
+                }
                 std::cout << "New template set with " << keysT.size() << " features.\n" << std::endl;
             } else {
                 std::cout << "ROI selection cancelled. Continuing with previous template.\n" << std::endl;
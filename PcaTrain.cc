@@ -0,0 +1,140 @@
+#include <iostream>
+#include <iomanip>
+#include <opencv2/opencv.hpp>
+#include "XFeat.h"
+#include "Matcher.h"
+#include "Timer.h"
+
+
+// Learns a PCA projection of the XFeat descriptors of an image set, saves it next to the model and reports the
+// match inlier ratio of consecutive image pairs for 64, 32 and 16 dimensional descriptors.
+int main(int argc, char** argv) {
+    std::string modelFile = "../../model/xfeat_640x640.onnx";
+    std::string imagePattern = "../../data/*.png";
+    std::string outFile;
+    int maxCorners = 1000;
+    bool whiten = false;
+    float minScore = 0.82f;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--model" && i + 1 < argc) {
+            modelFile = argv[++i];
+        } else if (arg == "--images" && i + 1 < argc) {
+            imagePattern = argv[++i];
+        } else if (arg == "--out" && i + 1 < argc) {
+            outFile = argv[++i];
+        } else if (arg == "--maxCorners" && i + 1 < argc) {
+            maxCorners = std::stoi(argv[++i]);
+        } else if (arg == "--whiten" && i + 1 < argc) {
+            whiten = std::stoi(argv[++i]) != 0;
+        } else if (arg == "--minScore" && i + 1 < argc) {
+            minScore = std::stof(argv[++i]);
+        } else if (arg == "--help") {
+            std::cout << "Usage: PcaTrain [--model <model>] [--images <glob>] [--out <file>] [--maxCorners <n>]"
+                         " [--whiten <0|1>] [--minScore <s>]\n";
+            std::cout << "  Images are ideally an ordered sequence of the scene, consecutive pairs are matched\n";
+            std::cout << "  for the report. The projection is saved to <model>.pca.yml unless --out is given.\n";
+            return 0;
+        }
+    }
+    if (outFile.empty()) {
+        outFile = modelFile + ".pca.yml";
+    }
+
+    std::vector<cv::String> imageFiles;
+    cv::glob(imagePattern, imageFiles);
+    std::vector<cv::Mat> images;
+    for (const auto &file : imageFiles) {
+        cv::Mat img = cv::imread(file, cv::IMREAD_GRAYSCALE);
+        if (img.empty()) {
+            std::cerr << "Failed to read image: " << file << std::endl;
+            continue;
+        }
+        cv::resize(img, img, cv::Size(640, 640));
+        images.push_back(img);
+    }
+    if (images.empty()) {
+        std::cerr << "ERROR: No images found for " << imagePattern << std::endl;
+        return -1;
+    }
+
+    try {
+        XFeat xfeat(modelFile);
+
+        // descriptors of all images as PCA samples
+        cv::Mat samples;
+        for (const auto &img : images) {
+            std::vector<cv::KeyPoint> keys;
+            cv::Mat descs;
+            xfeat.DetectAndCompute(img, keys, descs, maxCorners);
+            samples.push_back(descs);
+        }
+        if (samples.rows < 64) {
+            std::cerr << "ERROR: Too few descriptors for PCA: " << samples.rows << std::endl;
+            return -1;
+        }
+
+        cv::PCA pca(samples, cv::noArray(), cv::PCA::DATA_AS_ROW);
+        cv::FileStorage fs(outFile, cv::FileStorage::WRITE);
+        fs << "mean" << pca.mean << "eigenvectors" << pca.eigenvectors << "eigenvalues" << pca.eigenvalues;
+        fs.release();
+
+        const double total = cv::sum(pca.eigenvalues)[0];
+        std::cout << "PCA of " << samples.rows << " descriptors from " << images.size() << " images saved to "
+                  << outFile << std::endl;
+        std::cout << std::fixed << std::setprecision(3);
+        std::cout << "Explained variance: 16 dims " << cv::sum(pca.eigenvalues.rowRange(0, 16))[0] / total
+                  << ", 32 dims " << cv::sum(pca.eigenvalues.rowRange(0, 32))[0] / total << std::endl;
+
+        if (images.size() < 2) {
+            std::cout << "Need at least two images for the inlier ratio report." << std::endl;
+            return 0;
+        }
+
+        // inlier ratio of the matches of consecutive images, with the homography as ground truth proxy
+        std::cout << "\n dim | matches | inliers | inlier ratio | match ms" << std::endl;
+        for (int dim : {64, 32, 16}) {
+            if (!xfeat.LoadProjection(outFile, dim, whiten)) {
+                return -1;
+            }
+            std::vector<std::vector<cv::KeyPoint>> keys(images.size());
+            std::vector<cv::Mat> descs(images.size());
+            for (size_t i = 0; i < images.size(); ++i) {
+                xfeat.DetectAndCompute(images[i], keys[i], descs[i], maxCorners);
+            }
+
+            double matchCount = 0, inlierCount = 0, matchTime = 0;
+            for (size_t i = 0; i + 1 < images.size(); ++i) {
+                Timer timer;
+                std::vector<cv::DMatch> matches;
+                Matcher::Match(descs[i], descs[i + 1], matches, minScore);
+                matchTime += timer.Elapse();
+                matchCount += (double)matches.size();
+                if (matches.size() < 4) {
+                    continue;
+                }
+                std::vector<cv::Point2f> pts1, pts2;
+                for (const auto &m : matches) {
+                    pts1.push_back(keys[i][m.queryIdx].pt);
+                    pts2.push_back(keys[i + 1][m.trainIdx].pt);
+                }
+                cv::Mat inlierMask;
+                cv::Mat H = cv::findHomography(pts1, pts2, cv::USAC_MAGSAC, 4.0, inlierMask, 700, 0.995);
+                if (!H.empty()) {
+                    inlierCount += cv::countNonZero(inlierMask);
+                }
+            }
+            const double pairs = (double)(images.size() - 1);
+            std::cout << std::setw(4) << dim << " | " << std::setw(7) << matchCount / pairs << " | "
+                      << std::setw(7) << inlierCount / pairs << " | " << std::setw(12)
+                      << (matchCount > 0 ? inlierCount / matchCount : 0.0) << " | " << matchTime * 1e3 / pairs
+                      << std::endl;
+        }
+    }
+    catch (const Ort::Exception& e) {
+        std::cout << "ERROR: " << e.what() << std::endl;
+    }
+
+    return 0;
+}
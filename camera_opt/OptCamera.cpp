@@ -52,6 +52,10 @@ bool OptCamera::connect() {
         return false;
     }
 
+    session_ = std::shared_ptr<void>(handle_, [](void* handle) {
+        OPT_Close(handle);
+        OPT_DestroyHandle(handle);
+    });
     return true;
 }
 
@@ -63,14 +67,19 @@ void OptCamera::disconnect() {
         isGrabbing_ = false;
     }
 
-    OPT_Close(handle_);
-    OPT_DestroyHandle(handle_);
+    // the handle is closed now, or when the last grabbed Frame is released
     handle_ = nullptr;
+    session_.reset();
 }
 
 bool OptCamera::startGrabbing() {
     if (!isConnected()) return false;
-    int ret = OPT_StartGrabbing(handle_);
+    // the buffer count can not be changed while grabbing
+    int ret = OPT_SetBufferCount(handle_, bufferCount_);
+    if (ret != OPT_OK) {
+        std::cerr << "OPT_SetBufferCount(" << bufferCount_ << ") failed: " << ret << std::endl;
+    }
+    ret = OPT_StartGrabbing(handle_);
     if (ret != OPT_OK) {
         std::cerr << "OPT_StartGrabbing failed: " << ret << std::endl;
         return false;
@@ -91,7 +100,13 @@ bool OptCamera::stopGrabbing() {
 }
 
 cv::Mat OptCamera::captureImage(int timeout_ms) {
-    cv::Mat out;
+    Frame frame = grabFrame(timeout_ms);
+    // the frame goes back to the SDK when this returns
+    return frame.aliased() ? frame.mat().clone() : frame.mat();
+}
+
+OptCamera::Frame OptCamera::grabFrame(int timeout_ms) {
+    Frame out;
     if (!isConnected()) return out;
 
     OPT_Frame frame;
@@ -101,51 +116,47 @@ cv::Mat OptCamera::captureImage(int timeout_ms) {
         return out;
     }
 
-    // The SDK frame structure is expected to provide image buffer pointer and frame info
-    // Try to read commonly available fields; this is a minimal implementation that
-    // handles common pixel types (Mono8, BGR8, RGB8). The frame buffer is copied
-    // into an OpenCV Mat and then SDK frame is released.
-
-    unsigned int width = 0, height = 0;
-    int pixelType = 0;
-    unsigned char* buf = nullptr;
-
-    // Defensive extraction: many SDKs expose frame.frameInfo.width/height/pixelType and pImgBuf
-    // We'll attempt access and fallback conservatively if unavailable at compile-time.
-    // Note: headers in camera_opt/include provide the real definitions; here we assume names.
-    width = (unsigned int)frame.frameInfo.width;    // 图像宽度	 
-    height = (unsigned int)frame.frameInfo.height;  // 图像高度	
-    pixelType = (int)frame.frameInfo.pixelFormat;   // 图像像素格式		
-    buf = (unsigned char*)frame.pData;              // 帧图像数据的内存首地址	
+    // Handles the common pixel types (Mono8, BGR8, RGB8). Mono8 and BGR8 are wrapped in place, the SDK frame is
+    // released by the deleter of out.frame_, which also keeps the camera handle alive until then.
+    unsigned int width = (unsigned int)frame.frameInfo.width;    // 图像宽度
+    unsigned int height = (unsigned int)frame.frameInfo.height;  // 图像高度
+    int pixelType = (int)frame.frameInfo.pixelFormat;           // 图像像素格式
+    unsigned char* buf = (unsigned char*)frame.pData;           // 帧图像数据的内存首地址
 
     if (buf == nullptr || width == 0 || height == 0) {
         OPT_ReleaseFrame(handle_, &frame);
         return out;
     }
+    out.blockId_ = frame.frameInfo.blockId;
+    out.timeStamp_ = frame.frameInfo.timeStamp;
 
-    if (pixelType == gvspPixelMono8) {
-        // single channel
-        cv::Mat tmp((int)height, (int)width, CV_8UC1, buf);
-        out = tmp.clone();
-    }
-    else if (pixelType == gvspPixelBGR8) {
-        cv::Mat tmp((int)height, (int)width, CV_8UC3, buf);
-        out = tmp.clone();
-    }
-    else if (pixelType == gvspPixelRGB8) {
+    if (pixelType == gvspPixelRGB8) {
         cv::Mat tmp((int)height, (int)width, CV_8UC3, buf);
-        cv::cvtColor(tmp, out, cv::COLOR_RGB2BGR);
-    }
-    else {
-        // Unsupported pixel format: try to treat as mono8
-        cv::Mat tmp((int)height, (int)width, CV_8UC1, buf);
-        out = tmp.clone();
+        cv::cvtColor(tmp, out.mat_, cv::COLOR_RGB2BGR);
+        OPT_ReleaseFrame(handle_, &frame);
+        return out;
     }
 
-    OPT_ReleaseFrame(handle_, &frame);
+    std::shared_ptr<void> session = session_;
+    out.frame_ = std::shared_ptr<OPT_Frame>(new OPT_Frame(frame), [session](OPT_Frame* f) {
+        OPT_ReleaseFrame(session.get(), f);
+        delete f;
+    });
+    // unsupported pixel formats are treated as mono8
+    const int type = pixelType == gvspPixelBGR8 ? CV_8UC3 : CV_8UC1;
+    out.mat_ = cv::Mat((int)height, (int)width, type, out.frame_->pData);
     return out;
 }
 
+bool OptCamera::setBufferCount(unsigned count) {
+    if (count == 0) return false;
+    if (isGrabbing_) {
+        std::cerr << "OptCamera: the buffer count is applied by the next startGrabbing()" << std::endl;
+    }
+    bufferCount_ = count;
+    return true;
+}
+
 bool OptCamera::setExposureTime(int64_t exposure_us) {
     // Many GenICam-style SDKs expose property set APIs (e.g., OPT_SetInt/OPT_SetDouble).
     // The open header `OPTApi.h` in this workspace may contain such functions, but they
@@ -7,6 +7,30 @@
 
 class OptCamera {
 public:
+    // A grabbed frame left in its SDK buffer: mat() aliases the buffer (no copy) while any copy of the Frame is
+    // alive, and the buffer goes back to the SDK (OPT_ReleaseFrame) when the last copy is destroyed. Do not keep
+    // mat() past the Frame, clone it instead. RGB8 frames are converted to BGR, so they own their pixels.
+    class Frame {
+    public:
+        bool empty() const { return mat_.empty(); }
+
+        const cv::Mat &mat() const { return mat_; }
+
+        // true while mat() points into an SDK buffer
+        bool aliased() const { return frame_ != nullptr; }
+
+        uint64_t blockId() const { return blockId_; }
+
+        uint64_t timeStamp() const { return timeStamp_; }
+
+    private:
+        friend class OptCamera;
+        cv::Mat mat_;
+        std::shared_ptr<OPT_Frame> frame_;  // its deleter releases the SDK buffer
+        uint64_t blockId_ = 0;
+        uint64_t timeStamp_ = 0;
+    };
+
     // Construct by device index in enumerated list (default 0)
     explicit OptCamera(unsigned index = 0);
     ~OptCamera();
@@ -25,6 +49,13 @@ public:
     // returns empty Mat on failure
     cv::Mat captureImage(int timeout_ms = 500);
 
+    // same as captureImage without copying the frame out of the SDK buffer, empty Frame on failure
+    Frame grabFrame(int timeout_ms = 500);
+
+    // number of SDK frame buffers, applied by the next startGrabbing(). Every Frame held by the caller occupies
+    // one, so it must exceed the frames held at once through the pipeline or acquisition starves.
+    bool setBufferCount(unsigned count);
+
     // best-effort setter for exposure. Some SDKs expose control via properties;
     // this is a stub that returns true for now (user may extend using SDK property API).
     bool setExposureTime(int64_t exposure_us);
@@ -35,4 +66,7 @@ private:
     unsigned cameraIndex_;
     OPT_HANDLE handle_;
     bool isGrabbing_;
+    unsigned bufferCount_ = 8;
+    // owns handle_ (closed and destroyed with the last reference), grabbed Frames keep it alive until released
+    std::shared_ptr<void> session_;
 };
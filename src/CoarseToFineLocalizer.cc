@@ -0,0 +1,191 @@
+#include "CoarseToFineLocalizer.h"
+#include "Geometry.h"
+#include "Timer.h"
+
+
+CoarseToFineLocalizer::CoarseToFineLocalizer(XFeat &xfeat, XFeat *fine, int maxCorners, double thresh,
+                                             int minInliers, double margin, float minScore)
+    : xfeat_(xfeat), fine_(fine), maxCorners_(maxCorners), thresh_(thresh), minInliers_(minInliers),
+      margin_(margin), minScore_(minScore) {}
+
+
+bool CoarseToFineLocalizer::SetTemplate(const cv::Mat &templ) {
+    Reset();
+    templSize_ = templ.size();
+    cv::Mat descs, descsFine;
+    Detect(xfeat_, templ, maxCorners_, keysT_, descs);
+    keysFineT_.clear();
+    if (fine_) {
+        Detect(*fine_, templ, maxCorners_, keysFineT_, descsFine);
+    }
+    if (keysT_.empty() || (fine_ && keysFineT_.empty())) {
+        std::cerr << "CoarseToFineLocalizer: no features found in the template" << std::endl;
+        descsT_.Clear();
+        fineT_.Clear();
+        return false;
+    }
+    descsT_.Prepare(descs);
+    if (fine_) {
+        fineT_.Prepare(descsFine);
+    } else {
+        fineT_.Clear();
+    }
+    return true;
+}
+
+
+bool CoarseToFineLocalizer::Locate(const cv::Mat &frame, Result &result) {
+    result = Result();
+    if (descsT_.Empty() || (fine_ && fineT_.Empty())) {
+        return false;
+    }
+    // crop matches must agree with the prior up to a few pixels of the downscaled frame, which covers both the
+    // coarse quantization and the motion since the tracked frame
+    const cv::Size input = xfeat_.InputSize();
+    const double coarseScale = std::max((double)frame.cols / input.width, (double)frame.rows / input.height);
+    const double priorThresh = 2 * thresh_ * std::max(coarseScale, 1.0);
+    if (!tracked_.empty() && CropPass(xfeat_, keysT_, descsT_, frame, tracked_, priorThresh, result)) {
+        tracked_ = result.H.clone();
+        return true;
+    }
+
+    // re-acquisition: whole frame, then a crop pass around it with the fine model if there is one
+    tracked_.release();
+    if (!CoarsePass(frame, result)) {
+        return false;
+    }
+    const cv::Mat coarseH = result.H;
+    const int coarseMatches = result.matches, coarseInliers = result.inliers;
+    const bool refined = fine_ ? CropPass(*fine_, keysFineT_, fineT_, frame, coarseH, priorThresh, result)
+                               : CropPass(xfeat_, keysT_, descsT_, frame, coarseH, priorThresh, result);
+    if (refined) {
+        tracked_ = result.H.clone();
+    } else {
+        result.H = coarseH;
+        result.matches = coarseMatches;
+        result.inliers = coarseInliers;
+    }
+    return true;
+}
+
+
+bool CoarseToFineLocalizer::CoarsePass(const cv::Mat &frame, Result &result) {
+    Timer timer;
+    result.coarse = true;
+    std::vector<cv::KeyPoint> keysF;
+    cv::Mat descsF;
+    Detect(xfeat_, frame, maxCorners_, keysF, descsF);
+    MatchSet matches;
+    if (!keysF.empty()) {
+        Matcher::Match(descsT_, descsF, keysT_, keysF, matches, minScore_);
+    }
+    bool found = false;
+    if (matches.Size() >= minInliers_) {
+        // keypoints were scaled to frame pixels, so is the threshold
+        const cv::Size input = xfeat_.InputSize();
+        const double scale = std::max((double)frame.cols / input.width, (double)frame.rows / input.height);
+        std::vector<uchar> inliers;
+        result.H = Geometry::FindHomography(matches, inliers, thresh_ * std::max(scale, 1.0));
+        result.matches = matches.Size();
+        result.inliers = result.H.empty() ? 0 : cv::countNonZero(inliers);
+        found = result.inliers >= minInliers_;
+    }
+    if (!found) {
+        result.H.release();
+    }
+    result.coarseSeconds += timer.Elapse();
+    return found;
+}
+
+
+bool CoarseToFineLocalizer::CropPass(XFeat &xfeat, const std::vector<cv::KeyPoint> &keysT,
+                                     const PreparedDescriptors &descsT, const cv::Mat &frame, const cv::Mat &prior,
+                                     double priorThresh, Result &result) {
+    Timer timer;
+    const float w = (float)templSize_.width, h = (float)templSize_.height;
+    const std::vector<cv::Point2f> corners = {{0, 0}, {w, 0}, {w, h}, {0, h}};
+    std::vector<cv::Point2f> projected;
+    cv::perspectiveTransform(corners, projected, prior);
+    const cv::Rect frameRect(0, 0, frame.cols, frame.rows);
+    const cv::Rect box = cv::boundingRect(projected) & frameRect;
+    if (box.width < 16 || box.height < 16) {
+        return false;
+    }
+
+    // padded box grown to the model input, never upsampled and kept inside the frame. A box that fits in the input
+    // is seen at native resolution, so the run costs no more than on the downscaled frame.
+    const cv::Size input = xfeat.InputSize();
+    const double aspect = (double)input.width / input.height;
+    double cropW = std::max({box.width * (1 + 2 * margin_), box.height * (1 + 2 * margin_) * aspect,
+                             (double)input.width});
+    double cropH = cropW / aspect;
+    const double fit = std::min({1.0, frame.cols / cropW, frame.rows / cropH});
+    cropW *= fit;
+    cropH *= fit;
+    const double cx = box.x + box.width * 0.5, cy = box.y + box.height * 0.5;
+    cv::Rect roi((int)std::round(cx - cropW * 0.5), (int)std::round(cy - cropH * 0.5), (int)cropW, (int)cropH);
+    roi.x = std::clamp(roi.x, 0, frame.cols - roi.width);
+    roi.y = std::clamp(roi.y, 0, frame.rows - roi.height);
+    result.roi = roi;
+
+    // keypoints only where the template is expected
+    std::vector<cv::KeyPoint> keysF;
+    cv::Mat descsF;
+    Detect(xfeat, frame(roi), maxCorners_, keysF, descsF, {box - roi.tl()});
+    for (auto &key : keysF) {
+        key.pt.x += (float)roi.x;
+        key.pt.y += (float)roi.y;
+    }
+    MatchSet matches;
+    if (!keysF.empty()) {
+        Matcher::Match(descsT, descsF, keysT, keysF, matches, minScore_);
+    }
+
+    // matches far from the prior are outliers whatever the fine model says
+    std::vector<uchar> inliers;
+    Geometry::CountInliers(Geometry::Model::Homography, prior, matches.ptsQuery, matches.ptsTrain, inliers,
+                           priorThresh);
+    matches.Keep(inliers);
+    bool found = false;
+    if (matches.Size() >= minInliers_) {
+        cv::Mat H = Geometry::FindHomography(matches, inliers, thresh_);
+        const int count = H.empty() ? 0 : cv::countNonZero(inliers);
+        if (count >= minInliers_) {
+            result.H = H;
+            result.matches = matches.Size();
+            result.inliers = count;
+            found = true;
+        }
+    }
+    result.fine = found;
+    result.fineSeconds += timer.Elapse();
+    return found;
+}
+
+
+void CoarseToFineLocalizer::Detect(XFeat &xfeat, const cv::Mat &img, int maxCorners,
+                                   std::vector<cv::KeyPoint> &keys, cv::Mat &descs,
+                                   const std::vector<cv::Rect> &rois) {
+    const cv::Size input = xfeat.InputSize();
+    const double sx = (double)input.width / img.cols, sy = (double)input.height / img.rows;
+    cv::Mat resized;
+    if (img.size() == input) {
+        resized = img;
+    } else {
+        cv::resize(img, resized, input, 0, 0, sx < 1 && sy < 1 ? cv::INTER_AREA : cv::INTER_LINEAR);
+    }
+    if (rois.empty()) {
+        xfeat.DetectAndCompute(resized, keys, descs, maxCorners);
+    } else {
+        std::vector<cv::Rect> scaled;
+        for (const auto &roi : rois) {
+            scaled.emplace_back((int)std::floor(roi.x * sx), (int)std::floor(roi.y * sy),
+                                (int)std::ceil(roi.width * sx), (int)std::ceil(roi.height * sy));
+        }
+        xfeat.DetectAndCompute(resized, keys, descs, maxCorners, scaled);
+    }
+    for (auto &key : keys) {
+        key.pt.x = (float)(key.pt.x / sx);
+        key.pt.y = (float)(key.pt.y / sy);
+    }
+}
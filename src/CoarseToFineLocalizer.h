@@ -0,0 +1,66 @@
+#pragma once
+
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include "XFeat.h"
+#include "Matcher.h"
+
+
+// Template localization at the native resolution of the frame for the cost of one low resolution network run.
+// While the template is tracked, the model (e.g. xfeat_640x640) only sees a crop of the full resolution frame
+// around the outline predicted by the last homography, grown to the model input and never upsampled. A template
+// that fits in the input is therefore matched at native resolution, and the frame costs the same single run as
+// detecting on the downscaled frame. When the track is lost, the model sees the whole frame downscaled to its
+// input, and the coarse homography is refined by a crop pass, run with the optional fine model (e.g.
+// xfeat_800x576) if one is given. Only these re-acquisition frames cost two network runs.
+class CoarseToFineLocalizer {
+public:
+    struct Result {
+        cv::Mat H;               // template -> full resolution frame, empty if not found
+        int matches = 0;         // matches of the pass that gave H
+        int inliers = 0;
+        bool coarse = false;     // the whole frame pass ran on this frame (re-acquisition)
+        bool fine = false;       // H comes from a full resolution crop pass
+        cv::Rect roi;            // frame region seen by the crop pass
+        double coarseSeconds = 0;
+        double fineSeconds = 0;
+    };
+
+    // the models are used, not owned, fine may be null. margin pads the predicted template box on every side,
+    // relative to its size.
+    CoarseToFineLocalizer(XFeat &xfeat, XFeat *fine = nullptr, int maxCorners = 1000, double thresh = 4.0,
+                          int minInliers = 15, double margin = 0.15, float minScore = 0.82f);
+
+    // grayscale template, H maps its pixel coordinates whatever its size
+    bool SetTemplate(const cv::Mat &templ);
+
+    // grayscale frame at full resolution, returns false if the template is not found
+    bool Locate(const cv::Mat &frame, Result &result);
+
+    // forgets the tracked homography, the next frame starts with the whole frame pass
+    void Reset() { tracked_.release(); }
+
+private:
+    bool CoarsePass(const cv::Mat &frame, Result &result);
+
+    // xfeat on a full resolution crop around the template outline predicted by prior
+    bool CropPass(XFeat &xfeat, const std::vector<cv::KeyPoint> &keysT, const PreparedDescriptors &descsT,
+                  const cv::Mat &frame, const cv::Mat &prior, double priorThresh, Result &result);
+
+    // detects on img resized to the input of xfeat, keypoints are scaled back to img pixels
+    static void Detect(XFeat &xfeat, const cv::Mat &img, int maxCorners, std::vector<cv::KeyPoint> &keys,
+                       cv::Mat &descs, const std::vector<cv::Rect> &rois = {});
+
+    XFeat &xfeat_;
+    XFeat *fine_;
+    int maxCorners_;
+    double thresh_;
+    int minInliers_;
+    double margin_;
+    float minScore_;
+
+    cv::Size templSize_;
+    std::vector<cv::KeyPoint> keysT_, keysFineT_;
+    PreparedDescriptors descsT_, fineT_;
+    cv::Mat tracked_;            // last crop pass homography
+};
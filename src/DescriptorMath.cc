@@ -0,0 +1,51 @@
+#include "DescriptorMath.h"
+#include "Matcher.h"
+#include "Simd.h"
+
+
+namespace descmath {
+
+cv::Mat AsFloat(const cv::Mat &descs) {
+    if (descs.type() == CV_32F) {
+        return descs;
+    }
+    cv::Mat d;
+    descs.convertTo(d, CV_32F, descs.type() == CV_8S ? 1.0 / Matcher::kInt8Scale : 1.0);
+    return d;
+}
+
+
+#if defined(XFEAT_X86)
+// the whole blocks of 16 dimensions of Dot, returns the number of dimensions done
+XFEAT_TARGET("avx2,fma,f16c") static int DotAvx2(const float *a, const float *b, int dim, float &sum) {
+    int k = 0;
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    for (; k + 16 <= dim; k += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k), _mm256_loadu_ps(b + k), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k + 8), _mm256_loadu_ps(b + k + 8), acc1);
+    }
+    const __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    sum = _mm_cvtss_f32(s);
+    return k;
+}
+#endif
+
+
+float Dot(const float *a, const float *b, int dim) {
+    int k = 0;
+    float sum = 0.f;
+#if defined(XFEAT_X86)
+    if (simd::HasAvx2()) {
+        k = DotAvx2(a, b, dim, sum);
+    }
+#endif
+    for (; k < dim; ++k) {
+        sum += a[k] * b[k];
+    }
+    return sum;
+}
+
+}  // namespace descmath
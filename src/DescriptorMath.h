@@ -0,0 +1,16 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+
+// Descriptor helpers shared by Matcher, HnswIndex and IvfPqIndex
+namespace descmath {
+
+// float copy of descriptors in any of the supported storage types (CV_32F is returned as is, CV_8S codes are
+// rescaled by 1 / Matcher::kInt8Scale)
+cv::Mat AsFloat(const cv::Mat &descs);
+
+// a . b, with AVX2 and FMA when the CPU has them
+float Dot(const float *a, const float *b, int dim);
+
+}  // namespace descmath
@@ -0,0 +1,699 @@
+#include "Geometry.h"
+#include "Simd.h"
+#include "Timer.h"
+#include <atomic>
+#include <bit>
+#include <numeric>
+
+
+namespace {
+
+using Model = Geometry::Model;
+
+constexpr int kBatch = 8;              // points scored per SIMD step
+constexpr int kMaxSampleSize = 8;
+constexpr double kProsacGrowth = 2e5;  // samples after which PROSAC draws from all points (T_N)
+constexpr double kModelCost = 200;     // cost of a minimal solve in point evaluations, for the SPRT threshold
+constexpr double kCollinearSin = 0.02;  // samples with a flatter triangle are rejected as ill-conditioned
+
+
+// correspondences as float arrays padded to whole batches, shuffled with rng so that the sequential SPRT sees an
+// unbiased sample, the padding has NaN targets and never counts as an inlier
+struct PointBatch {
+    std::vector<float> x1, y1, x2, y2;
+    std::vector<int> index;  // original index of every position
+    int n = 0;
+
+    void Assign(const std::vector<cv::Point2f> &src, const std::vector<cv::Point2f> &dst, cv::RNG *rng) {
+        n = (int)src.size();
+        const int padded = (n + kBatch - 1) / kBatch * kBatch;
+        index.resize(n);
+        std::iota(index.begin(), index.end(), 0);
+        for (int i = n - 1; i > 0 && rng; --i) {
+            std::swap(index[i], index[rng->uniform(0, i + 1)]);
+        }
+        x1.assign(padded, 0.f);
+        y1.assign(padded, 0.f);
+        x2.assign(padded, std::numeric_limits<float>::quiet_NaN());
+        y2.assign(padded, std::numeric_limits<float>::quiet_NaN());
+        for (int i = 0; i < n; ++i) {
+            x1[i] = src[index[i]].x;
+            y1[i] = src[index[i]].y;
+            x2[i] = dst[index[i]].x;
+            y2[i] = dst[index[i]].y;
+        }
+    }
+};
+
+
+// Bit t of the result is set if point b * kBatch + t is within thresh2 (squared) of the model h: transfer error
+// of the projective transform h (similarity, affine, homography), or Sampson distance of the fundamental matrix h.
+template <bool kSampson>
+unsigned BatchInliers(const PointBatch &pts, int b, const float *h, float thresh2) {
+    const int k = b * kBatch;
+    unsigned bits = 0;
+    for (int t = 0; t < kBatch; ++t) {
+        const float x = pts.x1[k + t], y = pts.y1[k + t], u = pts.x2[k + t], v = pts.y2[k + t];
+        float err;
+        if (kSampson) {
+            const float l0 = h[0] * x + h[1] * y + h[2], l1 = h[3] * x + h[4] * y + h[5];
+            const float l2 = h[6] * x + h[7] * y + h[8];
+            const float m0 = h[0] * u + h[3] * v + h[6], m1 = h[1] * u + h[4] * v + h[7];
+            const float e = u * l0 + v * l1 + l2;
+            err = e * e / (l0 * l0 + l1 * l1 + m0 * m0 + m1 * m1);
+        } else {
+            const float iw = 1.f / (h[6] * x + h[7] * y + h[8]);
+            const float dx = (h[0] * x + h[1] * y + h[2]) * iw - u;
+            const float dy = (h[3] * x + h[4] * y + h[5]) * iw - v;
+            err = dx * dx + dy * dy;
+        }
+        bits |= (unsigned)(err < thresh2) << t;
+    }
+    return bits;
+}
+
+
+#if defined(XFEAT_X86)
+// a * x + b * y + c
+XFEAT_TARGET("avx2,fma") inline __m256 Lin(__m256 x, __m256 y, float a, float b, float c) {
+    return _mm256_fmadd_ps(_mm256_set1_ps(a), x, _mm256_fmadd_ps(_mm256_set1_ps(b), y, _mm256_set1_ps(c)));
+}
+
+
+// BatchInliers scoring the 8 points at once
+template <bool kSampson>
+XFEAT_TARGET("avx2,fma") unsigned BatchInliersAvx2(const PointBatch &pts, int b, const float *h, float thresh2) {
+    const int k = b * kBatch;
+    const __m256 x = _mm256_loadu_ps(&pts.x1[k]), y = _mm256_loadu_ps(&pts.y1[k]);
+    const __m256 u = _mm256_loadu_ps(&pts.x2[k]), v = _mm256_loadu_ps(&pts.y2[k]);
+    __m256 err;
+    if (kSampson) {
+        // (x2^T F x1)^2 / (|(F x1)_01|^2 + |(F^T x2)_01|^2)
+        const __m256 l0 = Lin(x, y, h[0], h[1], h[2]), l1 = Lin(x, y, h[3], h[4], h[5]);
+        const __m256 l2 = Lin(x, y, h[6], h[7], h[8]);
+        const __m256 m0 = Lin(u, v, h[0], h[3], h[6]), m1 = Lin(u, v, h[1], h[4], h[7]);
+        const __m256 e = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, l0), _mm256_mul_ps(v, l1)), l2);
+        const __m256 g = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(l0, l0), _mm256_mul_ps(l1, l1)),
+                                       _mm256_add_ps(_mm256_mul_ps(m0, m0), _mm256_mul_ps(m1, m1)));
+        err = _mm256_div_ps(_mm256_mul_ps(e, e), g);
+    } else {
+        const __m256 iw = _mm256_div_ps(_mm256_set1_ps(1.f), Lin(x, y, h[6], h[7], h[8]));
+        const __m256 dx = _mm256_sub_ps(_mm256_mul_ps(Lin(x, y, h[0], h[1], h[2]), iw), u);
+        const __m256 dy = _mm256_sub_ps(_mm256_mul_ps(Lin(x, y, h[3], h[4], h[5]), iw), v);
+        err = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+    }
+    return (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(err, _mm256_set1_ps(thresh2), _CMP_LT_OQ));
+}
+#endif
+
+
+using BatchFn = unsigned (*)(const PointBatch &, int, const float *, float);
+
+
+// the BatchInliers kernel of the model for this CPU, chosen once per scoring loop
+BatchFn BatchInliersFn(Model model) {
+    const bool sampson = model == Model::Fundamental;
+#if defined(XFEAT_X86)
+    if (simd::HasAvx2()) {
+        return sampson ? BatchInliersAvx2<true> : BatchInliersAvx2<false>;
+    }
+#endif
+    return sampson ? BatchInliers<true> : BatchInliers<false>;
+}
+
+
+// squared residual of one correspondence, as scored by BatchInliers
+double Residual2(Model model, const cv::Matx33d &M, const cv::Point2f &p, const cv::Point2f &q) {
+    const cv::Vec3d l = M * cv::Vec3d(p.x, p.y, 1.0);
+    if (model == Model::Fundamental) {
+        const cv::Vec3d m = M.t() * cv::Vec3d(q.x, q.y, 1.0);
+        const double e = q.x * l[0] + q.y * l[1] + l[2];
+        return e * e / (l[0] * l[0] + l[1] * l[1] + m[0] * m[0] + m[1] * m[1]);
+    }
+    const double dx = l[0] / l[2] - q.x, dy = l[1] / l[2] - q.y;
+    return dx * dx + dy * dy;
+}
+
+
+// Wald's sequential test: a model is rejected as soon as the likelihood ratio of "bad" vs "good" exceeds A
+struct Sprt {
+    double epsilon = 0.1;  // inlier ratio of a good model
+    double delta = 0.01;   // inlier ratio of a bad model
+    double logA = 0;
+    double logInlier = 0, logOutlier = 0;
+    double deltaSum = 0;
+    int rejected = 0;
+
+    void Update() {
+        delta = std::clamp(delta, 1e-4, 0.5);
+        epsilon = std::clamp(epsilon, delta * 1.01, 0.999);
+        logInlier = std::log(delta / epsilon);
+        logOutlier = std::log((1 - delta) / (1 - epsilon));
+        // A = kModelCost * C + 1 + log(A), C being the expected information of one point on a bad model
+        const double C = (1 - delta) * logOutlier + delta * logInlier;
+        const double A0 = kModelCost * C + 1;
+        double A = A0;
+        for (int i = 0; i < 10; ++i) {
+            A = A0 + std::log(A);
+        }
+        logA = std::log(A);
+    }
+
+    double A() const { return std::exp(logA); }
+};
+
+
+// inlier count of the model among the first tested points. rejected is set if SPRT rejected it, which may happen
+// on the last batch too, i.e. with all the points tested.
+int SprtCount(Model model, const PointBatch &pts, const float *h, float thresh2, const Sprt *sprt, int &tested,
+              bool &rejected) {
+    rejected = false;
+    const int batches = (pts.n + kBatch - 1) / kBatch;
+    const BatchFn batchInliers = BatchInliersFn(model);
+    int count = 0;
+    double lambda = 0;
+    for (int b = 0; b < batches; ++b) {
+        const int k = std::popcount(batchInliers(pts, b, h, thresh2));
+        count += k;
+        if (sprt) {
+            const int valid = std::min(kBatch, pts.n - b * kBatch);
+            lambda += k * sprt->logInlier + (valid - k) * sprt->logOutlier;
+            if (lambda > sprt->logA) {
+                tested = b * kBatch + valid;
+                rejected = true;
+                return count;
+            }
+        }
+    }
+    tested = pts.n;
+    return count;
+}
+
+
+int InlierMask(Model model, const PointBatch &pts, const float *h, float thresh2, std::vector<uchar> &mask) {
+    mask.assign(pts.n, 0);
+    int count = 0;
+    const int batches = (pts.n + kBatch - 1) / kBatch;
+    const BatchFn batchInliers = BatchInliersFn(model);
+    for (int b = 0; b < batches; ++b) {
+        const unsigned bits = batchInliers(pts, b, h, thresh2);
+        for (int t = 0; t < kBatch && b * kBatch + t < pts.n; ++t) {
+            mask[pts.index[b * kBatch + t]] = (uchar)((bits >> t) & 1);
+        }
+        count += std::popcount(bits);
+    }
+    return count;
+}
+
+
+// scale-free: the sine of the angle at p0 is below kCollinearSin (about 1 degree, one pixel off a 50 px baseline),
+// coincident points count as collinear
+bool Collinear(const cv::Point2f &p0, const cv::Point2f &p1, const cv::Point2f &p2) {
+    const cv::Point2d d1(p1 - p0), d2(p2 - p0);
+    return std::abs(d1.cross(d2)) <= kCollinearSin * std::sqrt(d1.dot(d1) * d2.dot(d2));
+}
+
+
+// Rejects samples the model cannot be fitted to: coincident points for the similarity, collinear triangles for
+// the affine transform, and for the homography collinear triples or triangles that flip orientation
+// inconsistently between the two images, which no homography does.
+bool ValidSample(Model model, const cv::Point2f *a, const cv::Point2f *b) {
+    switch (model) {
+        case Model::Similarity:
+            return cv::norm(a[1] - a[0]) > 1e-3 && cv::norm(b[1] - b[0]) > 1e-3;
+        case Model::Affine:
+            return !Collinear(a[0], a[1], a[2]) && !Collinear(b[0], b[1], b[2]);
+        case Model::Homography: {
+            static const int triples[4][3] = {{0, 1, 2}, {0, 1, 3}, {0, 2, 3}, {1, 2, 3}};
+            int sign = 0;
+            for (const auto &t : triples) {
+                if (Collinear(a[t[0]], a[t[1]], a[t[2]]) || Collinear(b[t[0]], b[t[1]], b[t[2]])) {
+                    return false;
+                }
+                const float ca = (a[t[1]] - a[t[0]]).cross(a[t[2]] - a[t[0]]);
+                const float cb = (b[t[1]] - b[t[0]]).cross(b[t[2]] - b[t[0]]);
+                const int s = (ca > 0) == (cb > 0) ? 1 : -1;
+                if (sign != 0 && s != sign) {
+                    return false;
+                }
+                sign = s;
+            }
+            return true;
+        }
+        default:
+            return true;
+    }
+}
+
+
+// centroid and mean distance sqrt(2) per image, for conditioning
+cv::Matx33d Normalization(const cv::Point2f *p, int n) {
+    double cx = 0, cy = 0, d = 0;
+    for (int i = 0; i < n; ++i) {
+        cx += p[i].x;
+        cy += p[i].y;
+    }
+    cx /= n;
+    cy /= n;
+    for (int i = 0; i < n; ++i) {
+        d += std::hypot(p[i].x - cx, p[i].y - cy);
+    }
+    const double s = d > 0 ? std::sqrt(2.0) * n / d : 1.0;
+    return cv::Matx33d(s, 0, -s * cx, 0, s, -s * cy, 0, 0, 1);
+}
+
+
+// least-squares x -> [A -B; B A] x + t, exact for 2 points
+bool SolveSimilarity(const cv::Point2f *a, const cv::Point2f *b, int n, cv::Matx33d &M) {
+    cv::Point2d ca, cb;
+    for (int i = 0; i < n; ++i) {
+        ca += cv::Point2d(a[i]);
+        cb += cv::Point2d(b[i]);
+    }
+    ca *= 1.0 / n;
+    cb *= 1.0 / n;
+    double sxx = 0, sdot = 0, scross = 0;
+    for (int i = 0; i < n; ++i) {
+        const cv::Point2d p = cv::Point2d(a[i]) - ca, q = cv::Point2d(b[i]) - cb;
+        sxx += p.dot(p);
+        sdot += p.dot(q);
+        scross += p.cross(q);
+    }
+    if (sxx < 1e-9) {
+        return false;
+    }
+    const double A = sdot / sxx, B = scross / sxx;
+    M = cv::Matx33d(A, -B, cb.x - A * ca.x + B * ca.y, B, A, cb.y - B * ca.x - A * ca.y, 0, 0, 1);
+    return true;
+}
+
+
+// least-squares affine transform on centered points, exact for 3 points
+bool SolveAffine(const cv::Point2f *a, const cv::Point2f *b, int n, cv::Matx33d &M) {
+    cv::Point2d ca, cb;
+    for (int i = 0; i < n; ++i) {
+        ca += cv::Point2d(a[i]);
+        cb += cv::Point2d(b[i]);
+    }
+    ca *= 1.0 / n;
+    cb *= 1.0 / n;
+    double sxx = 0, sxy = 0, syy = 0, sxu = 0, syu = 0, sxv = 0, syv = 0;
+    for (int i = 0; i < n; ++i) {
+        const cv::Point2d p = cv::Point2d(a[i]) - ca, q = cv::Point2d(b[i]) - cb;
+        sxx += p.x * p.x;
+        sxy += p.x * p.y;
+        syy += p.y * p.y;
+        sxu += p.x * q.x;
+        syu += p.y * q.x;
+        sxv += p.x * q.y;
+        syv += p.y * q.y;
+    }
+    const double det = sxx * syy - sxy * sxy;
+    if (std::abs(det) < 1e-9 * (sxx * syy + 1e-12)) {
+        return false;
+    }
+    const double a00 = (syy * sxu - sxy * syu) / det, a01 = (sxx * syu - sxy * sxu) / det;
+    const double a10 = (syy * sxv - sxy * syv) / det, a11 = (sxx * syv - sxy * sxv) / det;
+    M = cv::Matx33d(a00, a01, cb.x - a00 * ca.x - a01 * ca.y, a10, a11, cb.y - a10 * ca.x - a11 * ca.y, 0, 0, 1);
+    return true;
+}
+
+
+// 4-point homography with h33 = 1
+bool SolveHomography(const cv::Point2f *a, const cv::Point2f *b, cv::Matx33d &H) {
+    const cv::Matx33d Na = Normalization(a, 4), Nb = Normalization(b, 4);
+    cv::Matx<double, 8, 8> A;
+    cv::Vec<double, 8> rhs;
+    for (int i = 0; i < 4; ++i) {
+        const double x = Na(0, 0) * a[i].x + Na(0, 2), y = Na(1, 1) * a[i].y + Na(1, 2);
+        const double u = Nb(0, 0) * b[i].x + Nb(0, 2), v = Nb(1, 1) * b[i].y + Nb(1, 2);
+        const double r0[8] = {x, y, 1, 0, 0, 0, -u * x, -u * y};
+        const double r1[8] = {0, 0, 0, x, y, 1, -v * x, -v * y};
+        for (int c = 0; c < 8; ++c) {
+            A(2 * i, c) = r0[c];
+            A(2 * i + 1, c) = r1[c];
+        }
+        rhs[2 * i] = u;
+        rhs[2 * i + 1] = v;
+    }
+    cv::Vec<double, 8> h;
+    if (!cv::solve(A, rhs, h, cv::DECOMP_LU)) {
+        return false;
+    }
+    const cv::Matx33d Hn(h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7], 1.0);
+    H = Nb.inv() * Hn * Na;
+    if (std::abs(H(2, 2)) < 1e-12) {
+        return false;
+    }
+    H *= 1.0 / H(2, 2);
+    return true;
+}
+
+
+// normalized 8-point algorithm with the rank 2 constraint, least squares for more points
+bool SolveFundamental(const cv::Point2f *a, const cv::Point2f *b, int n, cv::Matx33d &F) {
+    const cv::Matx33d Na = Normalization(a, n), Nb = Normalization(b, n);
+    cv::Matx<double, 9, 9> AtA;
+    for (int i = 0; i < n; ++i) {
+        const double x = Na(0, 0) * a[i].x + Na(0, 2), y = Na(1, 1) * a[i].y + Na(1, 2);
+        const double u = Nb(0, 0) * b[i].x + Nb(0, 2), v = Nb(1, 1) * b[i].y + Nb(1, 2);
+        const double r[9] = {u * x, u * y, u, v * x, v * y, v, x, y, 1};
+        for (int p = 0; p < 9; ++p) {
+            for (int q = p; q < 9; ++q) {
+                AtA(p, q) += r[p] * r[q];
+            }
+        }
+    }
+    for (int p = 1; p < 9; ++p) {
+        for (int q = 0; q < p; ++q) {
+            AtA(p, q) = AtA(q, p);
+        }
+    }
+    cv::Vec<double, 9> evals;
+    cv::Matx<double, 9, 9> evecs;
+    if (!cv::eigen(AtA, evals, evecs)) {
+        return false;
+    }
+    // eigenvector of the smallest eigenvalue, then the closest rank 2 matrix
+    cv::Matx33d Fn((const double*)&evecs.val[8 * 9]);
+    cv::Vec3d w;
+    cv::Matx33d U, Vt;
+    cv::SVD::compute(Fn, w, U, Vt);
+    Fn = U * cv::Matx33d::diag(cv::Vec3d(w[0], w[1], 0)) * Vt;
+    F = Nb.t() * Fn * Na;
+    const double norm = cv::norm(F);
+    if (norm < 1e-12) {
+        return false;
+    }
+    F *= 1.0 / norm;
+    return true;
+}
+
+
+// minimal solver for n = SampleSize(model), least squares for larger n (not the homography, which is refined
+// with Matcher::refineHomography instead)
+bool Solve(Model model, const cv::Point2f *a, const cv::Point2f *b, int n, cv::Matx33d &M) {
+    switch (model) {
+        case Model::Similarity:
+            return SolveSimilarity(a, b, n, M);
+        case Model::Affine:
+            return SolveAffine(a, b, n, M);
+        case Model::Homography:
+            return SolveHomography(a, b, M);
+        case Model::Fundamental:
+            return SolveFundamental(a, b, n, M);
+    }
+    return false;
+}
+
+
+inline void ToFloat(const cv::Matx33d &M, float *h) {
+    for (int k = 0; k < 9; ++k) h[k] = (float)M.val[k];
+}
+
+
+// Geometry::Fit, returns an empty model as soon as cancel is set
+cv::Mat FitModel(Model model, const std::vector<cv::Point2f> &src, const std::vector<cv::Point2f> &dst,
+                 const std::vector<float> &scores, std::vector<uchar> &inliers, double thresh, double confidence,
+                 int maxIters, const std::atomic<bool> *cancel) {
+    inliers.assign(src.size(), 0);
+    const int n = (int)src.size();
+    const int m = Geometry::SampleSize(model);
+    if (dst.size() != src.size() || (!scores.empty() && scores.size() != src.size())) {
+        std::cerr << "Geometry::Fit: " << src.size() << " source points, " << dst.size() << " target points and "
+                  << scores.size() << " scores" << std::endl;
+        return {};
+    }
+    if (n < m) {
+        return {};
+    }
+
+    // PROSAC draws from a prefix of the correspondences sorted by decreasing score
+    std::vector<int> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    if (!scores.empty()) {
+        std::stable_sort(order.begin(), order.end(), [&](int i, int j) { return scores[i] > scores[j]; });
+    }
+
+    cv::RNG rng(0x5eed);
+    PointBatch pts;
+    pts.Assign(src, dst, &rng);
+    const float thresh2 = (float)(thresh * thresh);
+
+    Sprt sprt;
+    sprt.Update();
+
+    // growth function: T_n samples are expected to come from the top n points
+    int poolSize = m;
+    double Tn = kProsacGrowth;
+    for (int i = 0; i < m; ++i) {
+        Tn *= (double)(m - i) / (double)(n - i);
+    }
+    double TnPrime = 1;
+
+    cv::Matx33d best;
+    int bestCount = 0;
+    int limit = maxIters;
+    int sample[kMaxSampleSize];
+    cv::Point2f a[kMaxSampleSize], b[kMaxSampleSize];
+    for (int t = 1; t <= limit; ++t) {
+        if (cancel && cancel->load(std::memory_order_relaxed)) {
+            return {};
+        }
+        while (t > TnPrime && poolSize < n) {
+            const double Tn1 = Tn * (poolSize + 1) / (poolSize + 1 - m);
+            TnPrime += std::ceil(Tn1 - Tn);
+            Tn = Tn1;
+            ++poolSize;
+        }
+        // the newest point of the pool plus m - 1 older ones, or any m of the pool once it stopped growing
+        const bool grown = TnPrime < t;
+        const int drawn = grown ? m : m - 1;
+        const int range = grown ? poolSize : poolSize - 1;
+        for (int i = 0; i < drawn; ++i) {
+            bool repeated;
+            do {
+                sample[i] = rng.uniform(0, range);
+                repeated = std::find(sample, sample + i, sample[i]) != sample + i;
+            } while (repeated);
+        }
+        if (!grown) {
+            sample[m - 1] = poolSize - 1;
+        }
+        for (int i = 0; i < m; ++i) {
+            a[i] = src[order[sample[i]]];
+            b[i] = dst[order[sample[i]]];
+        }
+
+        cv::Matx33d M;
+        if (!ValidSample(model, a, b) || !Solve(model, a, b, m, M)) {
+            continue;
+        }
+        float h[9];
+        ToFloat(M, h);
+        int tested = 0;
+        bool rejected = false;
+        const int count = SprtCount(model, pts, h, thresh2, &sprt, tested, rejected);
+        if (rejected) {
+            // rejected by SPRT, its inlier ratio so far estimates delta
+            sprt.deltaSum += (double)count / tested;
+            ++sprt.rejected;
+            const double delta = sprt.deltaSum / sprt.rejected;
+            if (std::abs(delta - sprt.delta) > 0.05 * sprt.delta) {
+                sprt.delta = delta;
+                sprt.Update();
+            }
+            continue;
+        }
+        if (count > bestCount) {
+            best = M;
+            bestCount = count;
+            sprt.epsilon = (double)count / n;
+            sprt.Update();
+
+            // samples needed to draw an all-inlier sample that also passes SPRT, with the given confidence
+            const double w = std::pow((double)count / n, m) * (1.0 - 1.0 / sprt.A());
+            if (w >= 1.0) {
+                limit = t;
+            } else if (w > 0) {
+                const double k = std::log(1.0 - confidence) / std::log(1.0 - w);
+                limit = std::min(maxIters, (int)std::ceil(std::max(k, 0.0)));
+            }
+        }
+    }
+    if (bestCount < m) {
+        return {};
+    }
+
+    // least-squares refinement on the inliers, kept if it does not lose inliers
+    float h[9];
+    ToFloat(best, h);
+    InlierMask(model, pts, h, thresh2, inliers);
+    std::vector<cv::Point2f> inSrc, inDst;
+    for (int i = 0; i < n; ++i) {
+        if (inliers[i]) {
+            inSrc.push_back(src[i]);
+            inDst.push_back(dst[i]);
+        }
+    }
+    cv::Matx33d refined = best;
+    if (model == Model::Homography) {
+        cv::Mat H(refined);
+        Matcher::refineHomography(H, inSrc, inDst);
+        refined = cv::Matx33d((const double*)H.ptr<double>());
+    } else if (!Solve(model, inSrc.data(), inDst.data(), (int)inSrc.size(), refined)) {
+        return cv::Mat(best);
+    }
+    ToFloat(refined, h);
+    std::vector<uchar> refinedInliers;
+    if (InlierMask(model, pts, h, thresh2, refinedInliers) >= bestCount) {
+        inliers.swap(refinedInliers);
+        return cv::Mat(refined);
+    }
+    return cv::Mat(best);
+}
+
+}  // namespace
+
+
+int Geometry::SampleSize(Model model) {
+    static const int sizes[] = {2, 3, 4, 8};
+    return sizes[(int)model];
+}
+
+
+const char *Geometry::ModelName(Model model) {
+    static const char *names[] = {"similarity", "affine", "homography", "fundamental"};
+    return names[(int)model];
+}
+
+
+bool Geometry::ParseModel(const std::string &name, Model &model) {
+    for (Model m : {Model::Similarity, Model::Affine, Model::Homography, Model::Fundamental}) {
+        if (name == ModelName(m)) {
+            model = m;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+cv::Mat Geometry::Fit(Model model, const std::vector<cv::Point2f> &src, const std::vector<cv::Point2f> &dst,
+                      const std::vector<float> &scores, std::vector<uchar> &inliers, double thresh,
+                      double confidence, int maxIters) {
+    return FitModel(model, src, dst, scores, inliers, thresh, confidence, maxIters, nullptr);
+}
+
+
+cv::Mat Geometry::Fit(Model model, const MatchSet &matches, std::vector<uchar> &inliers, double thresh,
+                      double confidence, int maxIters) {
+    return Fit(model, matches.ptsQuery, matches.ptsTrain, matches.scores, inliers, thresh, confidence, maxIters);
+}
+
+
+cv::Mat Geometry::FitEscalating(const MatchSet &matches, Model &model, std::vector<uchar> &inliers, Model maxModel,
+                                double thresh, double minInlierRatio, double maxResidual, double confidence,
+                                int maxIters) {
+    cv::Mat fitted;
+    std::vector<uchar> fittedInliers;
+    for (int i = 0; i <= (int)maxModel; ++i) {
+        const Model candidate = (Model)i;
+        std::vector<uchar> mask;
+        cv::Mat M = Fit(candidate, matches, mask, thresh, confidence, maxIters);
+        if (M.empty()) {
+            continue;
+        }
+        fitted = M;
+        fittedInliers.swap(mask);
+        model = candidate;
+
+        const cv::Matx33d Mx((const double*)M.ptr<double>());
+        int count = 0;
+        double sum2 = 0;
+        for (int k = 0; k < matches.Size(); ++k) {
+            if (fittedInliers[k]) {
+                sum2 += Residual2(candidate, Mx, matches.ptsQuery[k], matches.ptsTrain[k]);
+                ++count;
+            }
+        }
+        if (count >= minInlierRatio * matches.Size() && std::sqrt(sum2 / std::max(count, 1)) <= maxResidual) {
+            break;
+        }
+    }
+    inliers.swap(fittedInliers);
+    if (inliers.empty()) {
+        inliers.assign(matches.Size(), 0);
+    }
+    return fitted;
+}
+
+
+int Geometry::VerifyBatch(const std::vector<MatchSet> &sets, std::vector<Verification> &results, Model model,
+                          int stopInliers, double thresh, double confidence, int maxIters) {
+    const int count = (int)sets.size();
+    results.assign(count, Verification());
+    std::atomic<int> next{0};
+    std::atomic<bool> cancel{false};
+    // tasks take the next set instead of a fixed range, so sets start in order whatever the pool schedules
+    cv::parallel_for_(cv::Range(0, count), [&](const cv::Range &range) {
+        for (int r = range.start; r < range.end; ++r) {
+            const int i = next.fetch_add(1);
+            Verification &result = results[i];
+            if (cancel.load(std::memory_order_relaxed)) {
+                result.cancelled = true;
+                result.inliers.assign(sets[i].Size(), 0);
+                continue;
+            }
+            Timer timer;
+            result.M = FitModel(model, sets[i].ptsQuery, sets[i].ptsTrain, sets[i].scores, result.inliers, thresh,
+                                confidence, maxIters, &cancel);
+            result.seconds = timer.Elapse();
+            if (result.M.empty()) {
+                result.cancelled = cancel.load(std::memory_order_relaxed);
+                continue;
+            }
+            result.inlierCount = cv::countNonZero(result.inliers);
+            if (stopInliers > 0 && result.inlierCount >= stopInliers) {
+                cancel.store(true, std::memory_order_relaxed);
+            }
+        }
+    }, count);
+
+    int best = -1;
+    for (int i = 0; i < count; ++i) {
+        if (!results[i].M.empty() && (best < 0 || results[i].inlierCount > results[best].inlierCount)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+
+int Geometry::CountInliers(Model model, const cv::Mat &M, const std::vector<cv::Point2f> &src,
+                           const std::vector<cv::Point2f> &dst, std::vector<uchar> &inliers, double thresh) {
+    if (M.empty() || dst.size() != src.size()) {
+        inliers.assign(src.size(), 0);
+        return 0;
+    }
+    thread_local PointBatch pts;
+    pts.Assign(src, dst, nullptr);
+    cv::Mat M64;
+    M.convertTo(M64, CV_64F);
+    float h[9];
+    ToFloat(cv::Matx33d((const double*)M64.ptr<double>()), h);
+    return InlierMask(model, pts, h, (float)(thresh * thresh), inliers);
+}
+
+
+cv::Mat Geometry::FindHomography(const std::vector<cv::Point2f> &src, const std::vector<cv::Point2f> &dst,
+                                 const std::vector<float> &scores, std::vector<uchar> &inliers, double thresh,
+                                 double confidence, int maxIters) {
+    return Fit(Model::Homography, src, dst, scores, inliers, thresh, confidence, maxIters);
+}
+
+
+cv::Mat Geometry::FindHomography(const MatchSet &matches, std::vector<uchar> &inliers, double thresh,
+                                 double confidence, int maxIters) {
+    return Fit(Model::Homography, matches, inliers, thresh, confidence, maxIters);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include "Matcher.h"
+
+
+// Robust geometric verification of matches.
+class Geometry {
+public:
+    // models by increasing number of parameters, fitted from minimal samples of 2, 3, 4 and 8 points
+    enum class Model { Similarity, Affine, Homography, Fundamental };
+
+    static int SampleSize(Model model);
+
+    static const char *ModelName(Model model);
+
+    // "similarity", "affine", "homography" or "fundamental"
+    static bool ParseModel(const std::string &name, Model &model);
+
+    // Robust fit of src -> dst with PROSAC: minimal samples are drawn from the best scored correspondences first and
+    // the pool grows towards all of them. Hypotheses are verified with SPRT, which stops counting a bad model
+    // after a few points, and the iteration budget adapts to the best inlier ratio found. The final model is
+    // refined on its inliers. scores may be empty (samples are then drawn in the given order).
+    // Returns a 3x3 CV_64F matrix, the transform for Similarity, Affine (last row 0 0 1) and Homography, or F
+    // with dst^T F src = 0 for Fundamental (inliers by Sampson distance), or an empty Mat if no model is found.
+    // inliers[i] = 1 for the inliers of the returned model.
+    static cv::Mat Fit(Model model, const std::vector<cv::Point2f> &src, const std::vector<cv::Point2f> &dst,
+                       const std::vector<float> &scores, std::vector<uchar> &inliers, double thresh = 4.0,
+                       double confidence = 0.995, int maxIters = 700);
+
+    // ptsQuery -> ptsTrain, sampled by match score
+    static cv::Mat Fit(Model model, const MatchSet &matches, std::vector<uchar> &inliers, double thresh = 4.0,
+                       double confidence = 0.995, int maxIters = 700);
+
+    // Fits Similarity, then Affine, ... up to maxModel, and stops at the first model that keeps at least
+    // minInlierRatio of the matches with an RMS inlier residual below maxResidual pixels. A wrong model that is too
+    // simple leaves residuals spread up to thresh, a right one leaves noise only. model is set to the model
+    // returned, the last one fitted if none passes.
+    static cv::Mat FitEscalating(const MatchSet &matches, Model &model, std::vector<uchar> &inliers,
+                                 Model maxModel = Model::Homography, double thresh = 4.0, double minInlierRatio = 0.5,
+                                 double maxResidual = 2.0, double confidence = 0.995, int maxIters = 700);
+
+    // result of one correspondence set of VerifyBatch
+    struct Verification {
+        cv::Mat M;                   // empty if no model was found or the set was cancelled
+        std::vector<uchar> inliers;
+        int inlierCount = 0;
+        double seconds = 0;          // time spent on this set
+        bool cancelled = false;      // skipped, or stopped early, after another set won
+    };
+
+    // Fits model to every set concurrently, one set per task of cv::parallel_for_. Sets are started in the given
+    // order, so the most promising should come first. Once a set reaches stopInliers inliers (0 disables it), sets
+    // not started yet are skipped and running ones stop at their next hypothesis. Returns the index of the set
+    // with the most inliers, -1 if none has a model.
+    static int VerifyBatch(const std::vector<MatchSet> &sets, std::vector<Verification> &results,
+                           Model model = Model::Homography, int stopInliers = 0, double thresh = 4.0,
+                           double confidence = 0.995, int maxIters = 700);
+
+    // inliers of a given model in one batched pass, returns their count
+    static int CountInliers(Model model, const cv::Mat &M, const std::vector<cv::Point2f> &src,
+                            const std::vector<cv::Point2f> &dst, std::vector<uchar> &inliers, double thresh = 4.0);
+
+    // Fit(Model::Homography, ...), a drop-in for cv::findHomography
+    static cv::Mat FindHomography(const std::vector<cv::Point2f> &src, const std::vector<cv::Point2f> &dst,
+                                  const std::vector<float> &scores, std::vector<uchar> &inliers,
+                                  double thresh = 4.0, double confidence = 0.995, int maxIters = 700);
+
+    static cv::Mat FindHomography(const MatchSet &matches, std::vector<uchar> &inliers, double thresh = 4.0,
+                                  double confidence = 0.995, int maxIters = 700);
+};
@@ -0,0 +1,289 @@
+#include "HnswIndex.h"
+#include "DescriptorMath.h"
+#include <queue>
+
+
+// epoch tagged visited flags, reset in O(1) between searches
+struct HnswIndex::VisitedSet {
+    std::vector<uint32_t> tags;
+    uint32_t epoch = 0;
+
+    void Next(int n) {
+        if ((int)tags.size() < n) {
+            tags.resize(n, 0);
+        }
+        if (++epoch == 0) {
+            std::fill(tags.begin(), tags.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    bool Visit(int id) {
+        if (tags[id] == epoch) {
+            return false;
+        }
+        tags[id] = epoch;
+        return true;
+    }
+};
+
+
+// the graph is searched with the distance -score, smaller is better
+static inline float Distance(const float *a, const float *b, int dim) {
+    return -descmath::Dot(a, b, dim);
+}
+
+
+HnswIndex::HnswIndex(int dim, int M, int efConstruction)
+        : dim_(dim), M_(std::max(M, 2)), maxM0_(2 * std::max(M, 2)), efConstruction_(std::max(efConstruction, M)),
+          levelMult_(1.0 / std::log((double)std::max(M, 2))), rng_(100) {}
+
+
+void HnswIndex::Clear() {
+    size_ = 0;
+    entry_ = -1;
+    maxLevel_ = -1;
+    data_.clear();
+    levels_.clear();
+    links0_.clear();
+    upperLinks_.clear();
+}
+
+
+int *HnswIndex::Links(int id, int level) {
+    if (level == 0) {
+        return links0_.data() + (size_t)id * (maxM0_ + 1);
+    }
+    return upperLinks_[id].data() + (size_t)(level - 1) * (M_ + 1);
+}
+
+
+const int *HnswIndex::Links(int id, int level) const {
+    return const_cast<HnswIndex *>(this)->Links(id, level);
+}
+
+
+int HnswIndex::GreedyClosest(const float *q, int ep, int level) const {
+    float best = Distance(q, Vector(ep), dim_);
+    for (bool changed = true; changed;) {
+        changed = false;
+        const int *links = Links(ep, level);
+        for (int k = 1; k <= links[0]; ++k) {
+            const float d = Distance(q, Vector(links[k]), dim_);
+            if (d < best) {
+                best = d;
+                ep = links[k];
+                changed = true;
+            }
+        }
+    }
+    return ep;
+}
+
+
+// beam search of one layer, result holds up to ef (distance, id) pairs sorted by increasing distance
+void HnswIndex::SearchLayer(const float *q, int ep, int ef, int level, VisitedSet &visited,
+                            std::vector<std::pair<float, int>> &result) const {
+    using Entry = std::pair<float, int>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<>> candidates; // closest first
+    std::priority_queue<Entry> top;                                            // farthest first
+
+    visited.Next(size_);
+    visited.Visit(ep);
+    const float d0 = Distance(q, Vector(ep), dim_);
+    candidates.emplace(d0, ep);
+    top.emplace(d0, ep);
+
+    while (!candidates.empty()) {
+        const auto [d, c] = candidates.top();
+        if (d > top.top().first && (int)top.size() >= ef) {
+            break;
+        }
+        candidates.pop();
+
+        const int *links = Links(c, level);
+        for (int k = 1; k <= links[0]; ++k) {
+            const int n = links[k];
+            if (!visited.Visit(n)) {
+                continue;
+            }
+            const float dn = Distance(q, Vector(n), dim_);
+            if ((int)top.size() < ef || dn < top.top().first) {
+                candidates.emplace(dn, n);
+                top.emplace(dn, n);
+                if ((int)top.size() > ef) {
+                    top.pop();
+                }
+            }
+        }
+    }
+
+    result.resize(top.size());
+    for (int k = (int)top.size() - 1; k >= 0; --k) {
+        result[k] = top.top();
+        top.pop();
+    }
+}
+
+
+// HNSW neighbor heuristic: a candidate is kept only if it is closer to the new point than to any neighbor kept
+// so far, which keeps links in different directions instead of a tight cluster. candidates must be sorted.
+void HnswIndex::SelectNeighbors(std::vector<std::pair<float, int>> &candidates, int maxCount) const {
+    if ((int)candidates.size() <= maxCount) {
+        return;
+    }
+    int kept = 0;
+    for (size_t i = 0; i < candidates.size() && kept < maxCount; ++i) {
+        const auto &c = candidates[i];
+        bool good = true;
+        for (int s = 0; s < kept && good; ++s) {
+            good = Distance(Vector(c.second), Vector(candidates[s].second), dim_) >= c.first;
+        }
+        if (good) {
+            candidates[kept++] = c;
+        }
+    }
+    candidates.resize(kept);
+}
+
+
+// adds the link neighbor -> id, shrinking the neighbor list with the heuristic when it is full
+void HnswIndex::Connect(int neighbor, int id, int level) {
+    int *links = Links(neighbor, level);
+    const int maxCount = level == 0 ? maxM0_ : M_;
+    if (links[0] < maxCount) {
+        links[++links[0]] = id;
+        return;
+    }
+
+    const float *v = Vector(neighbor);
+    std::vector<std::pair<float, int>> candidates;
+    candidates.reserve(maxCount + 1);
+    candidates.emplace_back(Distance(v, Vector(id), dim_), id);
+    for (int k = 1; k <= links[0]; ++k) {
+        candidates.emplace_back(Distance(v, Vector(links[k]), dim_), links[k]);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    SelectNeighbors(candidates, maxCount);
+    links[0] = (int)candidates.size();
+    for (int k = 0; k < links[0]; ++k) {
+        links[k + 1] = candidates[k].second;
+    }
+}
+
+
+void HnswIndex::Insert(int id, VisitedSet &visited) {
+    const int level = (int)(-std::log(1.0 - rng_.uniform(0.0, 1.0)) * levelMult_);
+    levels_[id] = level;
+    upperLinks_[id].assign((size_t)level * (M_ + 1), 0);
+    if (entry_ < 0) {
+        entry_ = id;
+        maxLevel_ = level;
+        return;
+    }
+
+    const float *q = Vector(id);
+    int ep = entry_;
+    for (int l = maxLevel_; l > level; --l) {
+        ep = GreedyClosest(q, ep, l);
+    }
+
+    std::vector<std::pair<float, int>> candidates;
+    for (int l = std::min(level, maxLevel_); l >= 0; --l) {
+        SearchLayer(q, ep, efConstruction_, l, visited, candidates);
+        ep = candidates[0].second;
+        SelectNeighbors(candidates, M_);
+        int *links = Links(id, l);
+        links[0] = (int)candidates.size();
+        for (int k = 0; k < links[0]; ++k) {
+            links[k + 1] = candidates[k].second;
+        }
+        for (const auto &c : candidates) {
+            Connect(c.second, id, l);
+        }
+    }
+
+    if (level > maxLevel_) {
+        entry_ = id;
+        maxLevel_ = level;
+    }
+}
+
+
+void HnswIndex::Add(const cv::Mat &descs) {
+    if (descs.empty()) {
+        return;
+    }
+    if (descs.cols != dim_) {
+        std::cerr << "HnswIndex: descriptor dimension " << descs.cols << " does not match " << dim_ << std::endl;
+        return;
+    }
+    const cv::Mat d = descmath::AsFloat(descs);
+    const int n = d.rows;
+    data_.resize((size_t)(size_ + n) * dim_);
+    for (int i = 0; i < n; ++i) {
+        std::copy_n(d.ptr<float>(i), dim_, data_.data() + (size_t)(size_ + i) * dim_);
+    }
+    links0_.resize((size_t)(size_ + n) * (maxM0_ + 1), 0);
+    levels_.resize(size_ + n, 0);
+    upperLinks_.resize(size_ + n);
+
+    VisitedSet visited;
+    for (int i = 0; i < n; ++i) {
+        Insert(size_, visited);
+        ++size_;
+    }
+}
+
+
+void HnswIndex::Search(const cv::Mat &queries, int k, std::vector<std::vector<cv::DMatch>> &matches) const {
+    matches.assign(queries.rows, {});
+    if (size_ == 0 || queries.empty() || k <= 0) {
+        return;
+    }
+    if (queries.cols != dim_) {
+        std::cerr << "HnswIndex: query dimension " << queries.cols << " does not match " << dim_ << std::endl;
+        return;
+    }
+    const cv::Mat q = descmath::AsFloat(queries);
+    const int ef = std::max(ef_, k);
+
+    // a few stripes per thread, each with its own visited set
+    const int nstripes = std::min(q.rows, std::max(cv::getNumThreads(), 1) * 4);
+    cv::parallel_for_(cv::Range(0, q.rows), [&](const cv::Range &range) {
+        VisitedSet visited;
+        std::vector<std::pair<float, int>> result;
+        for (int i = range.start; i < range.end; ++i) {
+            const float *qi = q.ptr<float>(i);
+            int ep = entry_;
+            for (int l = maxLevel_; l > 0; --l) {
+                ep = GreedyClosest(qi, ep, l);
+            }
+            SearchLayer(qi, ep, ef, 0, visited, result);
+            const int count = std::min(k, (int)result.size());
+            matches[i].reserve(count);
+            for (int t = 0; t < count; ++t) {
+                matches[i].emplace_back(i, result[t].second, -result[t].first);
+            }
+        }
+    }, nstripes);
+}
+
+
+void HnswIndex::Match(const cv::Mat &queries, std::vector<cv::DMatch> &matches, float minScore,
+                      float maxRatio) const {
+    std::vector<std::vector<cv::DMatch>> knn;
+    Search(queries, maxRatio < 1.f ? 2 : 1, knn);
+
+    matches.clear();
+    for (const auto &m : knn) {
+        if (m.empty() || m[0].distance <= minScore) {
+            continue;
+        }
+        // ratio of descriptor distances, d^2 = 2 - 2 * score for normalized descriptors
+        if (m.size() > 1 && 2.f - 2.f * m[0].distance >= maxRatio * maxRatio * (2.f - 2.f * m[1].distance)) {
+            continue;
+        }
+        matches.push_back(m[0]);
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <iostream>
+#include <opencv2/opencv.hpp>
+
+
+// Approximate nearest neighbor index over L2-normalized descriptors (HNSW graph, inner product similarity).
+// Use it instead of Matcher::Match when every frame is matched against a large reference store: a query costs
+// O(ef * log N) dot products instead of N. Descriptors are added incrementally, queries run in parallel.
+// Add() must not be called concurrently with Search() / Match().
+class HnswIndex {
+public:
+    // M: graph degree (2 * M on the base layer), efConstruction: beam width used while inserting
+    explicit HnswIndex(int dim = 64, int M = 16, int efConstruction = 128);
+
+    // appends the rows of descs (CV_32F, CV_16F or CV_8S), their ids continue from Size()
+    void Add(const cv::Mat &descs);
+
+    void Clear();
+
+    int Size() const { return size_; }
+
+    int Dim() const { return dim_; }
+
+    // beam width of queries, larger is slower and more accurate (recall vs latency, see MatchBench)
+    void SetEf(int ef) { ef_ = std::max(ef, 1); }
+
+    int Ef() const { return ef_; }
+
+    // k best ids of the index for every row of queries, sorted by decreasing score, DMatch::distance holds the
+    // score as in Matcher::Match
+    void Search(const cv::Mat &queries, int k, std::vector<std::vector<cv::DMatch>> &matches) const;
+
+    // best match of every query with a score above minScore, maxRatio < 1 enables the ratio test against the
+    // second best id. queryIdx refers to queries, trainIdx to the index.
+    void Match(const cv::Mat &queries, std::vector<cv::DMatch> &matches, float minScore = 0.82f,
+               float maxRatio = 1.f) const;
+
+private:
+    struct VisitedSet;
+
+    const float *Vector(int id) const { return data_.data() + (size_t)id * dim_; }
+
+    // neighbor list of id at a layer, element 0 is the count
+    int *Links(int id, int level);
+
+    const int *Links(int id, int level) const;
+
+    int GreedyClosest(const float *q, int ep, int level) const;
+
+    void SearchLayer(const float *q, int ep, int ef, int level, VisitedSet &visited,
+                     std::vector<std::pair<float, int>> &result) const;
+
+    void SelectNeighbors(std::vector<std::pair<float, int>> &candidates, int maxCount) const;
+
+    // appends id to the level links of neighbor (only neighbor's list changes), pruned with SelectNeighbors when full
+    void Connect(int neighbor, int id, int level);
+
+    void Insert(int id, VisitedSet &visited);
+
+    int dim_;
+    int M_;
+    int maxM0_;
+    int efConstruction_;
+    int ef_ = 64;
+    double levelMult_;
+
+    int size_ = 0;
+    int entry_ = -1;
+    int maxLevel_ = -1;
+    std::vector<float> data_;
+    std::vector<int> levels_;
+    std::vector<int> links0_;                  // size_ x (maxM0_ + 1)
+    std::vector<std::vector<int>> upperLinks_; // per id, level x (M_ + 1)
+    cv::RNG rng_;
+};
@@ -0,0 +1,66 @@
+#include "HomographyTracker.h"
+#include "Geometry.h"
+
+
+cv::Mat HomographyTracker::Update(const MatchSet &matches, std::vector<uchar> &inliers) {
+    lastWarm_ = false;
+    if (matches.Size() < 4) {
+        inliers.assign(matches.Size(), 0);
+        Reset();
+        return cv::Mat();
+    }
+    if (Tracking() && WarmStart(matches, inliers)) {
+        lastWarm_ = true;
+        ++warmFrames_;
+        return H_.clone();
+    }
+
+    ++fullFrames_;
+    cv::Mat H = Geometry::FindHomography(matches, inliers, thresh_);
+    if (H.empty() || cv::countNonZero(inliers) < minInliers_) {
+        Reset();
+        return H;
+    }
+    H_ = H.clone();
+    return H;
+}
+
+
+void HomographyTracker::Reset() {
+    H_.release();
+    lastWarm_ = false;
+}
+
+
+bool HomographyTracker::WarmStart(const MatchSet &matches, std::vector<uchar> &inliers) {
+    const int n = matches.Size();
+    auto accepted = [&](int count) { return count >= minInliers_ && count >= minInlierRatio_ * n; };
+    const int count = Geometry::CountInliers(Geometry::Model::Homography, H_, matches.ptsQuery, matches.ptsTrain,
+                                             inliers, thresh_);
+    if (accepted(count)) {
+        return true;
+    }
+    if (!refine_ || count < 4) {
+        return false;
+    }
+
+    // one LM step on the inliers follows the motion since the previous frame, only paid when H_ no longer fits
+    inT_.clear();
+    inF_.clear();
+    for (int i = 0; i < n; ++i) {
+        if (inliers[i]) {
+            inT_.push_back(matches.ptsQuery[i]);
+            inF_.push_back(matches.ptsTrain[i]);
+        }
+    }
+    H_.copyTo(refinedH_);
+    Matcher::refineHomography(refinedH_, inT_, inF_, 1);
+    const int refinedCount = Geometry::CountInliers(Geometry::Model::Homography, refinedH_, matches.ptsQuery,
+                                                    matches.ptsTrain, refinedInliers_, thresh_);
+    if (!accepted(refinedCount)) {
+        return false;
+    }
+    cv::swap(H_, refinedH_);
+    inliers.swap(refinedInliers_);
+    return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include "Matcher.h"
+
+
+// Frame to frame homography with a warm start: the homography of the previous frame is scored against the new
+// matches first. While it still explains enough of them the robust search is skipped, so on a stable sequence the
+// geometry costs one batched inlier count. Otherwise one refinement step on its inliers is tried and scored again
+// (with refine), before falling back to Geometry::FindHomography.
+class HomographyTracker {
+public:
+    explicit HomographyTracker(double thresh = 4.0, double minInlierRatio = 0.6, int minInliers = 15,
+                               bool refine = true)
+        : thresh_(thresh), minInlierRatio_(minInlierRatio), minInliers_(minInliers), refine_(refine) {}
+
+    // homography ptsQuery -> ptsTrain of the matches, empty (and the tracker reset) if none is found;
+    // inliers[i] = 1 for its inliers
+    cv::Mat Update(const MatchSet &matches, std::vector<uchar> &inliers);
+
+    // forgets the previous homography, e.g. when the template changes
+    void Reset();
+
+    bool Tracking() const { return !H_.empty(); }
+
+    const cv::Mat &H() const { return H_; }
+
+    // whether the last Update() kept the previous homography
+    bool LastWarm() const { return lastWarm_; }
+
+    int WarmFrames() const { return warmFrames_; }
+
+    int FullFrames() const { return fullFrames_; }
+
+private:
+    bool WarmStart(const MatchSet &matches, std::vector<uchar> &inliers);
+
+    double thresh_;
+    double minInlierRatio_;
+    int minInliers_;
+    bool refine_;
+    cv::Mat H_;
+    bool lastWarm_ = false;
+    int warmFrames_ = 0;
+    int fullFrames_ = 0;
+    // reused by the refinement step
+    std::vector<cv::Point2f> inT_, inF_;
+    std::vector<uchar> refinedInliers_;
+    cv::Mat refinedH_;
+};
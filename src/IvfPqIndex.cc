@@ -0,0 +1,323 @@
+#include "IvfPqIndex.h"
+#include "DescriptorMath.h"
+#include "Simd.h"
+#include <numeric>
+
+
+// keeps the k largest (score, id) pairs, heap.front() is the smallest of them
+static inline void PushCandidate(std::vector<std::pair<float, int>> &heap, int k, float score, int id) {
+    if ((int)heap.size() < k) {
+        heap.emplace_back(score, id);
+        std::push_heap(heap.begin(), heap.end(), std::greater<>());
+    } else if (score > heap.front().first) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+        heap.back() = {score, id};
+        std::push_heap(heap.begin(), heap.end(), std::greater<>());
+    }
+}
+
+
+IvfPqIndex::IvfPqIndex(int dim, int nlist, int m, bool keepVectors)
+        : dim_(dim), nlist_(std::max(nlist, 1)), m_(std::max(m, 1)), dsub_(dim / std::max(m, 1)),
+          keepVectors_(keepVectors) {}
+
+
+bool IvfPqIndex::Train(const cv::Mat &descs) {
+    if (dim_ % m_ != 0) {
+        std::cerr << "IvfPqIndex: dimension " << dim_ << " is not a multiple of " << m_ << std::endl;
+        return false;
+    }
+    if (descs.cols != dim_) {
+        std::cerr << "IvfPqIndex: descriptor dimension " << descs.cols << " does not match " << dim_ << std::endl;
+        return false;
+    }
+    if (descs.rows < std::max(nlist_, kCodewords)) {
+        std::cerr << "IvfPqIndex: need at least " << std::max(nlist_, kCodewords) << " training descriptors, got "
+                  << descs.rows << std::endl;
+        return false;
+    }
+
+    const cv::Mat x = descmath::AsFloat(descs);
+    const cv::TermCriteria criteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 20, 1e-4);
+    cv::Mat labels;
+    cv::kmeans(x, nlist_, labels, criteria, 1, cv::KMEANS_PP_CENTERS, centroids_);
+    halfSqNorms_.resize(nlist_);
+    for (int c = 0; c < nlist_; ++c) {
+        halfSqNorms_[c] = 0.5f * descmath::Dot(centroids_.ptr<float>(c), centroids_.ptr<float>(c), dim_);
+    }
+
+    // one codebook per sub-space, learned on the residuals to the assigned centroids
+    cv::Mat residuals(x.rows, dim_, CV_32F);
+    for (int i = 0; i < x.rows; ++i) {
+        const float *xi = x.ptr<float>(i);
+        const float *c = centroids_.ptr<float>(labels.at<int>(i));
+        float *r = residuals.ptr<float>(i);
+        for (int d = 0; d < dim_; ++d) {
+            r[d] = xi[d] - c[d];
+        }
+    }
+    codebooks_.assign((size_t)dim_ * kCodewords, 0.f);
+    for (int j = 0; j < m_; ++j) {
+        const cv::Mat sub = residuals.colRange(j * dsub_, (j + 1) * dsub_).clone();
+        cv::Mat subLabels, codewords;
+        cv::kmeans(sub, kCodewords, subLabels, criteria, 1, cv::KMEANS_PP_CENTERS, codewords);
+        for (int c = 0; c < kCodewords; ++c) {
+            for (int d = 0; d < dsub_; ++d) {
+                codebooks_[(size_t)(j * dsub_ + d) * kCodewords + c] = codewords.at<float>(c, d);
+            }
+        }
+    }
+
+    Reset();
+    return true;
+}
+
+
+void IvfPqIndex::Reset() {
+    lists_.assign(IsTrained() ? nlist_ : 0, InvertedList());
+    vectors_.clear();
+    size_ = 0;
+}
+
+
+size_t IvfPqIndex::MemoryUsage() const {
+    size_t bytes = vectors_.size() * sizeof(float);
+    for (const auto &list : lists_) {
+        bytes += list.codes.size() + list.ids.size() * sizeof(int);
+    }
+    return bytes;
+}
+
+
+void IvfPqIndex::Encode(const float *residual, uint8_t *code) const {
+    float dists[kCodewords];
+    for (int j = 0; j < m_; ++j) {
+        std::fill(dists, dists + kCodewords, 0.f);
+        for (int d = 0; d < dsub_; ++d) {
+            const float v = residual[j * dsub_ + d];
+            const float *cb = codebooks_.data() + (size_t)(j * dsub_ + d) * kCodewords;
+            for (int c = 0; c < kCodewords; ++c) {
+                const float diff = v - cb[c];
+                dists[c] += diff * diff;
+            }
+        }
+        code[j] = (uint8_t)(std::min_element(dists, dists + kCodewords) - dists);
+    }
+}
+
+
+void IvfPqIndex::Add(const cv::Mat &descs) {
+    if (!IsTrained()) {
+        std::cerr << "IvfPqIndex: Add() called before Train()" << std::endl;
+        return;
+    }
+    if (descs.empty()) {
+        return;
+    }
+    if (descs.cols != dim_) {
+        std::cerr << "IvfPqIndex: descriptor dimension " << descs.cols << " does not match " << dim_ << std::endl;
+        return;
+    }
+
+    const cv::Mat x = descmath::AsFloat(descs);
+    if (keepVectors_) {
+        vectors_.reserve((size_t)(size_ + x.rows) * dim_);
+    }
+    std::vector<float> residual(dim_);
+    std::vector<uint8_t> code(m_);
+    // coarse assignment by GEMM, in chunks so that the score matrix stays small
+    constexpr int kChunk = 4096;
+    for (int r0 = 0; r0 < x.rows; r0 += kChunk) {
+        const int r1 = std::min(r0 + kChunk, x.rows);
+        const cv::Mat coarse = x.rowRange(r0, r1) * centroids_.t();
+        for (int i = r0; i < r1; ++i) {
+            const float *xi = x.ptr<float>(i);
+            const float *cs = coarse.ptr<float>(i - r0);
+            int cell = 0;
+            for (int c = 1; c < nlist_; ++c) {
+                if (cs[c] - halfSqNorms_[c] > cs[cell] - halfSqNorms_[cell]) {
+                    cell = c;
+                }
+            }
+            const float *centroid = centroids_.ptr<float>(cell);
+            for (int d = 0; d < dim_; ++d) {
+                residual[d] = xi[d] - centroid[d];
+            }
+            Encode(residual.data(), code.data());
+
+            InvertedList &list = lists_[cell];
+            const int n = (int)list.ids.size();
+            if (n % kBlock == 0) {
+                list.codes.resize(list.codes.size() + (size_t)m_ * kBlock, 0);
+            }
+            uint8_t *block = list.codes.data() + (size_t)(n / kBlock) * m_ * kBlock;
+            for (int j = 0; j < m_; ++j) {
+                block[j * kBlock + n % kBlock] = code[j];
+            }
+            list.ids.push_back(size_ + i);
+            if (keepVectors_) {
+                vectors_.insert(vectors_.end(), xi, xi + dim_);
+            }
+        }
+    }
+    size_ += x.rows;
+}
+
+
+// scores[t] = base + sum_j table[j][block[j * 8 + t]] for the 8 descriptors of a code block
+static void BlockScores(const uint8_t *block, const float *table, int m, int codewords, float base, float *scores) {
+    for (int t = 0; t < 8; ++t) {
+        float s = base;
+        for (int j = 0; j < m; ++j) {
+            s += table[j * codewords + block[j * 8 + t]];
+        }
+        scores[t] = s;
+    }
+}
+
+
+#if defined(XFEAT_X86)
+// t[c] = q . codeword c of a codebook stored dim-major with n codewords, n a multiple of 8
+XFEAT_TARGET("avx2,fma,f16c") static void CodewordScoresAvx2(const float *q, const float *cb, int dsub, int n,
+                                                              float *t) {
+    for (int c = 0; c < n; c += 8) {
+        __m256 acc = _mm256_setzero_ps();
+        for (int d = 0; d < dsub; ++d) {
+            acc = _mm256_fmadd_ps(_mm256_set1_ps(q[d]), _mm256_loadu_ps(cb + (size_t)d * n + c), acc);
+        }
+        _mm256_storeu_ps(t + c, acc);
+    }
+}
+
+
+// BlockScores with gathers
+XFEAT_TARGET("avx2,fma,f16c") static void BlockScoresAvx2(const uint8_t *block, const float *table, int m,
+                                                           int codewords, float base, float *scores) {
+    __m256 acc = _mm256_set1_ps(base);
+    for (int j = 0; j < m; ++j) {
+        const __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(block + j * 8)));
+        acc = _mm256_add_ps(acc, _mm256_i32gather_ps(table + j * codewords, idx, 4));
+    }
+    _mm256_storeu_ps(scores, acc);
+}
+#endif
+
+
+void IvfPqIndex::ComputeTable(const float *q, float *table) const {
+#if defined(XFEAT_X86)
+    if (simd::HasAvx2()) {
+        for (int j = 0; j < m_; ++j) {
+            CodewordScoresAvx2(q + j * dsub_, codebooks_.data() + (size_t)j * dsub_ * kCodewords, dsub_, kCodewords,
+                               table + j * kCodewords);
+        }
+        return;
+    }
+#endif
+    for (int j = 0; j < m_; ++j) {
+        float *t = table + j * kCodewords;
+        const float *cb = codebooks_.data() + (size_t)j * dsub_ * kCodewords;
+        for (int c = 0; c < kCodewords; ++c) {
+            float s = 0.f;
+            for (int d = 0; d < dsub_; ++d) {
+                s += q[j * dsub_ + d] * cb[(size_t)d * kCodewords + c];
+            }
+            t[c] = s;
+        }
+    }
+}
+
+
+// score = q . centroid + sum_j table[j][code_j], 8 codes per step with AVX2 gathers when the CPU has them
+void IvfPqIndex::ScanList(const InvertedList &list, const float *table, float base, int k,
+                          std::vector<std::pair<float, int>> &heap) const {
+    static_assert(kBlock == 8, "the AVX2 scan kernel scores blocks of 8 codes");
+    const int n = (int)list.ids.size();
+    float scores[kBlock];
+#if defined(XFEAT_X86)
+    const bool avx2 = simd::HasAvx2();
+#endif
+    for (int b = 0; b * kBlock < n; ++b) {
+        const uint8_t *block = list.codes.data() + (size_t)b * m_ * kBlock;
+#if defined(XFEAT_X86)
+        if (avx2) {
+            BlockScoresAvx2(block, table, m_, kCodewords, base, scores);
+        } else {
+            BlockScores(block, table, m_, kCodewords, base, scores);
+        }
+#else
+        BlockScores(block, table, m_, kCodewords, base, scores);
+#endif
+        const int count = std::min(kBlock, n - b * kBlock);
+        for (int t = 0; t < count; ++t) {
+            PushCandidate(heap, k, scores[t], list.ids[b * kBlock + t]);
+        }
+    }
+}
+
+
+void IvfPqIndex::Search(const cv::Mat &queries, int k, std::vector<std::vector<cv::DMatch>> &matches) const {
+    matches.assign(queries.rows, {});
+    if (size_ == 0 || queries.empty() || k <= 0) {
+        return;
+    }
+    if (queries.cols != dim_) {
+        std::cerr << "IvfPqIndex: query dimension " << queries.cols << " does not match " << dim_ << std::endl;
+        return;
+    }
+    const cv::Mat q = descmath::AsFloat(queries);
+    const int nprobe = std::min(nprobe_, nlist_);
+    const bool rerank = keepVectors_ && rerank_ > 0;
+    const int candidates = rerank ? std::max(k, rerank_) : k;
+
+    const int nstripes = std::min(q.rows, std::max(cv::getNumThreads(), 1) * 4);
+    cv::parallel_for_(cv::Range(0, q.rows), [&](const cv::Range &range) {
+        const cv::Mat coarse = q.rowRange(range.start, range.end) * centroids_.t();
+        std::vector<float> table((size_t)m_ * kCodewords);
+        std::vector<int> cells(nlist_);
+        std::vector<std::pair<float, int>> heap;
+        for (int i = range.start; i < range.end; ++i) {
+            const float *qi = q.ptr<float>(i);
+            const float *cs = coarse.ptr<float>(i - range.start);
+            std::iota(cells.begin(), cells.end(), 0);
+            std::partial_sort(cells.begin(), cells.begin() + nprobe, cells.end(), [&](int a, int b) {
+                return cs[a] - halfSqNorms_[a] > cs[b] - halfSqNorms_[b];
+            });
+
+            ComputeTable(qi, table.data());
+            heap.clear();
+            for (int p = 0; p < nprobe; ++p) {
+                ScanList(lists_[cells[p]], table.data(), cs[cells[p]], candidates, heap);
+            }
+            if (rerank) {
+                for (auto &c : heap) {
+                    c.first = descmath::Dot(qi, vectors_.data() + (size_t)c.second * dim_, dim_);
+                }
+            }
+            std::sort(heap.begin(), heap.end(), std::greater<>());
+            const int count = std::min(k, (int)heap.size());
+            matches[i].reserve(count);
+            for (int t = 0; t < count; ++t) {
+                matches[i].emplace_back(i, heap[t].second, heap[t].first);
+            }
+        }
+    }, nstripes);
+}
+
+
+void IvfPqIndex::Match(const cv::Mat &queries, std::vector<cv::DMatch> &matches, float minScore,
+                       float maxRatio) const {
+    std::vector<std::vector<cv::DMatch>> knn;
+    Search(queries, maxRatio < 1.f ? 2 : 1, knn);
+
+    matches.clear();
+    for (const auto &m : knn) {
+        if (m.empty() || m[0].distance <= minScore) {
+            continue;
+        }
+        // ratio of descriptor distances, d^2 = 2 - 2 * score for normalized descriptors
+        if (m.size() > 1 && 2.f - 2.f * m[0].distance >= maxRatio * maxRatio * (2.f - 2.f * m[1].distance)) {
+            continue;
+        }
+        matches.push_back(m[0]);
+    }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <iostream>
+#include <opencv2/opencv.hpp>
+
+
+// Compressed index for million-scale reference stores: an inverted file of nlist coarse k-means cells, and
+// every descriptor stored as the m byte product quantization code of its residual to the cell centroid
+// (m + 4 bytes per descriptor with its id, instead of 256 bytes of floats). Queries probe the nprobe closest
+// cells and score codes with an asymmetric table of query / codeword dot products. With keepVectors the float
+// descriptors are kept as well and the best candidates are re-ranked with the exact score.
+class IvfPqIndex {
+public:
+    // m sub-quantizers of 256 codewords each, dim must be a multiple of m (8 or 16 bytes for 64-dim XFeat)
+    explicit IvfPqIndex(int dim = 64, int nlist = 1024, int m = 8, bool keepVectors = false);
+
+    // learns the coarse centroids and the PQ codebooks from a sample of descriptors (CV_32F, CV_16F or CV_8S,
+    // e.g. from XFeat::DetectAndCompute over a few reference images), at least max(nlist, 256) rows
+    bool Train(const cv::Mat &descs);
+
+    bool IsTrained() const { return !centroids_.empty(); }
+
+    // encodes and appends the rows of descs, their ids continue from Size()
+    void Add(const cv::Mat &descs);
+
+    // drops the stored descriptors, keeps the trained quantizers
+    void Reset();
+
+    int Size() const { return size_; }
+
+    // bytes used by the codes, ids and kept vectors
+    size_t MemoryUsage() const;
+
+    // number of cells visited per query
+    void SetNprobe(int nprobe) { nprobe_ = std::max(nprobe, 1); }
+
+    // number of PQ candidates re-ranked with the exact score, needs keepVectors
+    void SetRerank(int candidates) { rerank_ = std::max(candidates, 0); }
+
+    // k best ids for every row of queries, sorted by decreasing score, DMatch::distance holds the score
+    void Search(const cv::Mat &queries, int k, std::vector<std::vector<cv::DMatch>> &matches) const;
+
+    // best match of every query with a score above minScore, maxRatio < 1 enables the ratio test
+    void Match(const cv::Mat &queries, std::vector<cv::DMatch> &matches, float minScore = 0.82f,
+               float maxRatio = 1.f) const;
+
+private:
+    static constexpr int kCodewords = 256;
+    static constexpr int kBlock = 8; // codes are interleaved in blocks of 8 descriptors for the scan kernel
+
+    // codes of one cell, block b holds byte j of descriptor b * kBlock + t at [(b * m + j) * kBlock + t]
+    struct InvertedList {
+        std::vector<uint8_t> codes;
+        std::vector<int> ids;
+    };
+
+    // coarse cells ordered by ||x - c||^2, i.e. by decreasing x . c - ||c||^2 / 2
+    void CoarseScores(const float *x, float *scores) const;
+
+    void Encode(const float *residual, uint8_t *code) const;
+
+    // table[j * 256 + c] = q_j . codeword_j[c]
+    void ComputeTable(const float *q, float *table) const;
+
+    void ScanList(const InvertedList &list, const float *table, float base, int k,
+                  std::vector<std::pair<float, int>> &heap) const;
+
+    int dim_;
+    int nlist_;
+    int m_;
+    int dsub_;
+    bool keepVectors_;
+    int nprobe_ = 8;
+    int rerank_ = 32;
+
+    int size_ = 0;
+    cv::Mat centroids_;                 // nlist x dim
+    std::vector<float> halfSqNorms_;    // ||c||^2 / 2
+    std::vector<float> codebooks_;      // (j * dsub + d) * 256 + c, dimension-major per sub-quantizer
+    std::vector<InvertedList> lists_;
+    std::vector<float> vectors_;        // size_ x dim when keepVectors
+};
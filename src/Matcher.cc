@@ -3,10 +3,14 @@
 //
 
 #include "Matcher.h"
+#include "DescriptorMath.h"
+#include "Simd.h"
+#include <bit>
+#include <numeric>
 
 
 template <typename T>
-static void ReduceVector(std::vector<T>& v, std::vector<uchar>& status) {
+static void ReduceVector(std::vector<T>& v, const std::vector<uchar>& status) {
     int j = 0;
     for (int i=0; i<(int)(v.size()); i++) {
         if (status[i]) {
@@ -17,49 +21,999 @@ static void ReduceVector(std::vector<T>& v, std::vector<uchar>& status) {
 }
 
 
+// The second set is packed in panels (see PreparedDescriptors) and scored against blocks of the first set,
+// the kernel keeps a 4x16 block of scores in registers while streaming a panel through the cache.
+// Scores are reduced tile by tile into running row/column maxima, the N x M score matrix is never stored.
+static constexpr int kPanelCols = PreparedDescriptors::kPanelCols;
+static constexpr int kTileRows = 64;
+static constexpr int kBlockRows = 4;
+static constexpr int kBlockCols = 16;
+
+
+#if defined(XFEAT_X86)
+// the whole blocks of 8 values of HalfToFloat, returns the number of converted values
+XFEAT_TARGET("avx2,fma,f16c") static int HalfToFloatF16c(const cv::float16_t *src, float *dst, int n) {
+    int k = 0;
+    for (; k + 8 <= n; k += 8) {
+        _mm256_storeu_ps(dst + k, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + k))));
+    }
+    return k;
+}
+#endif
+
+
+// fp16 -> fp32, 8 values per instruction with F16C when the CPU has AVX2
+static void HalfToFloat(const cv::float16_t *src, float *dst, int n) {
+    int k = 0;
+#if defined(XFEAT_X86)
+    if (simd::HasAvx2()) {
+        k = HalfToFloatF16c(src, dst, n);
+    }
+#endif
+    for (; k < n; ++k) {
+        dst[k] = (float)src[k];
+    }
+}
+
+
+// rows [r0, r0 + nr) of descs as floats with a row stride of lda. CV_32F rows are used in place, CV_16F and
+// CV_8S rows are converted into buf, so the other storage types never need a full float copy.
+static const float *RowsAsFloat(const cv::Mat &descs, int r0, int nr, std::vector<float> &buf, size_t &lda) {
+    const int dim = descs.cols;
+    if (descs.type() == CV_32F) {
+        lda = descs.step1();
+        return descs.ptr<float>(r0);
+    }
+    lda = dim;
+    buf.resize((size_t)nr * dim);
+    for (int r = 0; r < nr; ++r) {
+        float *dst = buf.data() + (size_t)r * dim;
+        if (descs.type() == CV_16F) {
+            HalfToFloat(descs.ptr<cv::float16_t>(r0 + r), dst, dim);
+        } else {
+            const auto *src = descs.ptr<int8_t>(r0 + r);
+            for (int k = 0; k < dim; ++k) {
+                dst[k] = (float)src[k] * (1.f / Matcher::kInt8Scale);
+            }
+        }
+    }
+    return buf.data();
+}
+
+
+// pack rows [c0, c0 + nc) of descs into a dim x kPanelCols panel, the padding columns are zeroed so that
+// the kernel can always work on full blocks
+static void PackPanel(const cv::Mat &descs, int c0, int nc, float *panel, std::vector<float> &buf) {
+    const int dim = descs.cols;
+    size_t lda;
+    const float *rows = RowsAsFloat(descs, c0, nc, buf, lda);
+    for (int c = 0; c < nc; ++c) {
+        const float *src = rows + c * lda;
+        for (int d = 0; d < dim; ++d) {
+            panel[d * kPanelCols + c] = src[d];
+        }
+    }
+    for (int d = 0; d < dim; ++d) {
+        std::fill(panel + d * kPanelCols + nc, panel + (d + 1) * kPanelCols, 0.f);
+    }
+}
+
+
+void PreparedDescriptors::Prepare(const cv::Mat &descs) {
+    rows_ = descs.rows;
+    dim_ = descs.cols;
+    panels_.create((rows_ + kPanelCols - 1) / kPanelCols, dim_ * kPanelCols, CV_32F);
+    std::vector<float> buf;
+    for (int p = 0; p < panels_.rows; ++p) {
+        const int c0 = p * kPanelCols;
+        PackPanel(descs, c0, std::min(kPanelCols, rows_ - c0), panels_.ptr<float>(p), buf);
+    }
+}
+
+
+void PreparedDescriptors::Clear() {
+    panels_.release();
+    rows_ = 0;
+    dim_ = 0;
+}
+
+
+// tile[r * kPanelCols + c] = dot(row r of a, panel column c), for r < nr
+static void ScoreTile(const float *a, size_t lda, int nr, int dim, const float *panel, float *tile) {
+    int r = 0;
+    for (; r + kBlockRows <= nr; r += kBlockRows) {
+        const float *a0 = a + r * lda;
+        const float *a1 = a0 + lda;
+        const float *a2 = a1 + lda;
+        const float *a3 = a2 + lda;
+        for (int c = 0; c < kPanelCols; c += kBlockCols) {
+            float acc0[kBlockCols] = {}, acc1[kBlockCols] = {}, acc2[kBlockCols] = {}, acc3[kBlockCols] = {};
+            for (int d = 0; d < dim; ++d) {
+                const float *b = panel + d * kPanelCols + c;
+                const float v0 = a0[d], v1 = a1[d], v2 = a2[d], v3 = a3[d];
+                for (int k = 0; k < kBlockCols; ++k) {
+                    acc0[k] += v0 * b[k];
+                    acc1[k] += v1 * b[k];
+                    acc2[k] += v2 * b[k];
+                    acc3[k] += v3 * b[k];
+                }
+            }
+            float *out = tile + r * kPanelCols + c;
+            for (int k = 0; k < kBlockCols; ++k) {
+                out[k] = acc0[k];
+                out[kPanelCols + k] = acc1[k];
+                out[2 * kPanelCols + k] = acc2[k];
+                out[3 * kPanelCols + k] = acc3[k];
+            }
+        }
+    }
+    for (; r < nr; ++r) {
+        const float *ar = a + r * lda;
+        for (int c = 0; c < kPanelCols; c += kBlockCols) {
+            float acc[kBlockCols] = {};
+            for (int d = 0; d < dim; ++d) {
+                const float *b = panel + d * kPanelCols + c;
+                const float v = ar[d];
+                for (int k = 0; k < kBlockCols; ++k) {
+                    acc[k] += v * b[k];
+                }
+            }
+            std::copy(acc, acc + kBlockCols, tile + r * kPanelCols + c);
+        }
+    }
+}
+
+
+#if defined(XFEAT_X86)
+// VNNI panel layout: for every group of 4 dimensions, the 4 bytes of each of the kPanelCols columns are
+// contiguous. vpdpbusd needs an unsigned operand, so the codes are stored offset by +128 and the offset is
+// removed with 128 * sum(a) afterwards. The products accumulate in int32 without intermediate saturation.
+static void PackPanelInt8(const cv::Mat &descs, int c0, int nc, uint8_t *panel) {
+    const int groups = descs.cols / 4;
+    std::fill(panel, panel + (size_t)groups * kPanelCols * 4, uint8_t(128));
+    for (int c = 0; c < nc; ++c) {
+        const auto *src = descs.ptr<int8_t>(c0 + c);
+        for (int g = 0; g < groups; ++g) {
+            for (int k = 0; k < 4; ++k) {
+                panel[((size_t)g * kPanelCols + c) * 4 + k] = (uint8_t)(src[g * 4 + k] + 128);
+            }
+        }
+    }
+}
+
+
+static int32_t SumInt8(const int8_t *a, int dim) {
+    int32_t sum = 0;
+    for (int k = 0; k < dim; ++k) {
+        sum += a[k];
+    }
+    return sum;
+}
+
+
+// both VNNI kernels keep kVnniAcc accumulators per row, 128 (AVX512) or 64 (AVX) columns of the panel
+static constexpr int kVnniAcc = 8;
+static_assert(kPanelCols % (kVnniAcc * 16) == 0, "panel width must be a multiple of the kernel width");
+
+
+// int8 version of ScoreTile on a VNNI panel with AVX512-VNNI, scores are rescaled to floats
+XFEAT_TARGET("avx512f,avx512bw,avx512vnni")
+static void ScoreTileVnni512(const cv::Mat &descs1, int r0, int nr, const uint8_t *panel, float *tile) {
+    constexpr int kLanes = 16;
+    const int dim = descs1.cols, groups = dim / 4;
+    const __m512 scale = _mm512_set1_ps(1.f / float(Matcher::kInt8Scale * Matcher::kInt8Scale));
+    for (int r = 0; r < nr; ++r) {
+        const auto *a = descs1.ptr<int8_t>(r0 + r);
+        const __m512i bias = _mm512_set1_epi32(128 * SumInt8(a, dim));
+        float *out = tile + r * kPanelCols;
+        for (int c = 0; c < kPanelCols; c += kVnniAcc * kLanes) {
+            __m512i acc[kVnniAcc];
+            for (auto &v : acc) {
+                v = _mm512_setzero_si512();
+            }
+            for (int g = 0; g < groups; ++g) {
+                int32_t a4;
+                memcpy(&a4, a + 4 * g, 4);
+                const __m512i va = _mm512_set1_epi32(a4);
+                const uint8_t *b = panel + ((size_t)g * kPanelCols + c) * 4;
+                for (int k = 0; k < kVnniAcc; ++k) {
+                    acc[k] = _mm512_dpbusd_epi32(acc[k], _mm512_loadu_si512(b + k * kLanes * 4), va);
+                }
+            }
+            for (int k = 0; k < kVnniAcc; ++k) {
+                _mm512_storeu_ps(out + c + k * kLanes,
+                                 _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(acc[k], bias)), scale));
+            }
+        }
+    }
+}
+
+
+// same with AVX-VNNI, the VEX encoded vpdpbusd of CPUs without AVX-512
+XFEAT_TARGET("avx2,fma,f16c,avxvnni")
+static void ScoreTileVnni256(const cv::Mat &descs1, int r0, int nr, const uint8_t *panel, float *tile) {
+    constexpr int kLanes = 8;
+    const int dim = descs1.cols, groups = dim / 4;
+    const __m256 scale = _mm256_set1_ps(1.f / float(Matcher::kInt8Scale * Matcher::kInt8Scale));
+    for (int r = 0; r < nr; ++r) {
+        const auto *a = descs1.ptr<int8_t>(r0 + r);
+        const __m256i bias = _mm256_set1_epi32(128 * SumInt8(a, dim));
+        float *out = tile + r * kPanelCols;
+        for (int c = 0; c < kPanelCols; c += kVnniAcc * kLanes) {
+            __m256i acc[kVnniAcc];
+            for (auto &v : acc) {
+                v = _mm256_setzero_si256();
+            }
+            for (int g = 0; g < groups; ++g) {
+                int32_t a4;
+                memcpy(&a4, a + 4 * g, 4);
+                const __m256i va = _mm256_set1_epi32(a4);
+                const uint8_t *b = panel + ((size_t)g * kPanelCols + c) * 4;
+                for (int k = 0; k < kVnniAcc; ++k) {
+                    const __m256i vb = _mm256_loadu_si256((const __m256i *)(b + k * kLanes * 4));
+                    acc[k] = _mm256_dpbusd_avx_epi32(acc[k], vb, va);
+                }
+            }
+            for (int k = 0; k < kVnniAcc; ++k) {
+                _mm256_storeu_ps(out + c + k * kLanes,
+                                 _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(acc[k], bias)), scale));
+            }
+        }
+    }
+}
+
+
+using VnniTileFn = void (*)(const cv::Mat &, int, int, const uint8_t *, float *);
+
+
+// the VNNI kernel of this CPU, null without VNNI
+static VnniTileFn VnniKernel() {
+    if (simd::HasAvx512Vnni()) {
+        return ScoreTileVnni512;
+    }
+    if (simd::HasAvxVnni()) {
+        return ScoreTileVnni256;
+    }
+    return nullptr;
+}
+
+
+// sums of each of the four accumulators
+XFEAT_TARGET("avx2,fma,f16c") static inline __m128i HorizontalSum4(__m256i a0, __m256i a1, __m256i a2, __m256i a3) {
+    __m256i s = _mm256_hadd_epi32(_mm256_hadd_epi32(a0, a1), _mm256_hadd_epi32(a2, a3));
+    return _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+}
+
+
+// AVX2 part of DotInt8x4 on the whole blocks of 32 dimensions, returns the number of dimensions done
+XFEAT_TARGET("avx2,fma,f16c")
+static int DotInt8x4Avx2(const int8_t *a, const int8_t *b0, const int8_t *b1, const int8_t *b2, const int8_t *b3,
+                         int dim, int32_t *out) {
+    int k = 0;
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    const __m256i ones = _mm256_set1_epi16(1);
+    for (; k + 32 <= dim; k += 32) {
+        const __m256i va = _mm256_loadu_si256((const __m256i *)(a + k));
+        const __m256i ua = _mm256_sign_epi8(va, va);
+        const __m256i v0 = _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *)(b0 + k)), va);
+        const __m256i v1 = _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *)(b1 + k)), va);
+        const __m256i v2 = _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *)(b2 + k)), va);
+        const __m256i v3 = _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *)(b3 + k)), va);
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_maddubs_epi16(ua, v0), ones));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_maddubs_epi16(ua, v1), ones));
+        acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_maddubs_epi16(ua, v2), ones));
+        acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_maddubs_epi16(ua, v3), ones));
+    }
+    _mm_storeu_si128((__m128i *)out, HorizontalSum4(acc0, acc1, acc2, acc3));
+    return k;
+}
+#endif
+
+
+// int8 dot products of a against b0..b3, used without VNNI. vpmaddubsw needs an unsigned operand, so |a| is
+// multiplied with b carrying the sign of a. Codes are within [-127, 127], so the int16 pair sums never saturate.
+static void DotInt8x4(const int8_t *a, const int8_t *b0, const int8_t *b1, const int8_t *b2, const int8_t *b3,
+                      int dim, int32_t *out) {
+    int k = 0;
+    out[0] = out[1] = out[2] = out[3] = 0;
+#if defined(XFEAT_X86)
+    if (simd::HasAvx2()) {
+        k = DotInt8x4Avx2(a, b0, b1, b2, b3, dim, out);
+    }
+#endif
+    for (; k < dim; ++k) {
+        out[0] += a[k] * b0[k];
+        out[1] += a[k] * b1[k];
+        out[2] += a[k] * b2[k];
+        out[3] += a[k] * b3[k];
+    }
+}
+
+
+// int8 version of ScoreTile, descs2 rows [c0, c0 + nc) are the tile columns, scores are rescaled to floats
+static void ScoreTileInt8(const cv::Mat &descs1, int r0, int nr, const cv::Mat &descs2, int c0, int nc,
+                          float *tile) {
+    const int dim = descs1.cols;
+    const float scale = 1.f / float(Matcher::kInt8Scale * Matcher::kInt8Scale);
+    int32_t dots[4];
+    for (int r = 0; r < nr; ++r) {
+        const auto *a = descs1.ptr<int8_t>(r0 + r);
+        float *out = tile + r * kPanelCols;
+        for (int c = 0; c < nc; c += 4) {
+            // the last block repeats the last column instead of reading past the end
+            const auto *b0 = descs2.ptr<int8_t>(c0 + c);
+            const auto *b1 = descs2.ptr<int8_t>(c0 + std::min(c + 1, nc - 1));
+            const auto *b2 = descs2.ptr<int8_t>(c0 + std::min(c + 2, nc - 1));
+            const auto *b3 = descs2.ptr<int8_t>(c0 + std::min(c + 3, nc - 1));
+            DotInt8x4(a, b0, b1, b2, b3, dim, dots);
+            for (int k = 0; k < 4 && c + k < nc; ++k) {
+                out[c + k] = (float)dots[k] * scale;
+            }
+        }
+    }
+}
+
+
+// running best (and optionally second best) scores of the rows and columns of a score matrix
+struct BestScores {
+    std::vector<int> rowIdx, colIdx;
+    std::vector<float> rowMax, colMax;
+    std::vector<float> rowSecond, colSecond;
+    bool top2 = false;
+
+    void Init(int n1, int n2, bool withSecond) {
+        const float lowest = -std::numeric_limits<float>::infinity();
+        top2 = withSecond;
+        rowIdx.assign(n1, -1);
+        rowMax.assign(n1, lowest);
+        colIdx.assign(n2, -1);
+        colMax.assign(n2, lowest);
+        rowSecond.assign(top2 ? n1 : 0, lowest);
+        colSecond.assign(top2 ? n2 : 0, lowest);
+    }
+};
+
+
+// update the running row maxima of rows [r0, r0 + nr) and column maxima of columns [c0, c0 + nc) with a tile.
+// Tiles are visited with increasing rows and columns and compared with strict '>', so the first maximum wins.
+// With kTop2 the second best scores are tracked in the same pass for the ratio test.
+template <bool kTop2>
+static void ReduceTile(const float *tile, int r0, int nr, int c0, int nc, BestScores &best) {
+    float *colMax = best.colMax.data() + c0;
+    int *colIdx = best.colIdx.data() + c0;
+    float *colSecond = kTop2 ? best.colSecond.data() + c0 : nullptr;
+    for (int r = 0; r < nr; ++r) {
+        const int i = r0 + r;
+        const float *row = tile + r * kPanelCols;
+        float maxScore = best.rowMax[i];
+        int maxIdx = best.rowIdx[i];
+        float secondScore = kTop2 ? best.rowSecond[i] : 0.f;
+        for (int c = 0; c < nc; ++c) {
+            const float s = row[c];
+            if (s > maxScore) {
+                if (kTop2) secondScore = maxScore;
+                maxScore = s;
+                maxIdx = c0 + c;
+            } else if (kTop2 && s > secondScore) {
+                secondScore = s;
+            }
+            if (s > colMax[c]) {
+                if (kTop2) colSecond[c] = colMax[c];
+                colMax[c] = s;
+                colIdx[c] = i;
+            } else if (kTop2 && s > colSecond[c]) {
+                colSecond[c] = s;
+            }
+        }
+        best.rowMax[i] = maxScore;
+        best.rowIdx[i] = maxIdx;
+        if (kTop2) best.rowSecond[i] = secondScore;
+    }
+}
+
+
+static void ReduceTile(const float *tile, int r0, int nr, int c0, int nc, BestScores &best) {
+    if (best.top2) {
+        ReduceTile<true>(tile, r0, nr, c0, nc, best);
+    } else {
+        ReduceTile<false>(tile, r0, nr, c0, nc, best);
+    }
+}
+
+
+// best scores of every row of descs1 and every descriptor of the second set,
+// panelAt(p) returns panel p of the n2 descriptors of the second set
+template <typename PanelFn>
+static void BestMatches(const cv::Mat &descs1, int n2, PanelFn panelAt, BestScores &best) {
+    const int n1 = descs1.rows, dim = descs1.cols;
+
+    std::vector<float> tile((size_t)kTileRows * kPanelCols);
+    std::vector<float> rowBuf;
+    for (int c0 = 0, p = 0; c0 < n2; c0 += kPanelCols, ++p) {
+        const int nc = std::min(kPanelCols, n2 - c0);
+        const float *panel = panelAt(p);
+        for (int r0 = 0; r0 < n1; r0 += kTileRows) {
+            const int nr = std::min(kTileRows, n1 - r0);
+            size_t lda;
+            const float *rows = RowsAsFloat(descs1, r0, nr, rowBuf, lda);
+            ScoreTile(rows, lda, nr, dim, panel, tile.data());
+            ReduceTile(tile.data(), r0, nr, c0, nc, best);
+        }
+    }
+}
+
+
+// same as above for two CV_8S descriptor sets
+static void BestMatchesInt8(const cv::Mat &descs1, const cv::Mat &descs2, BestScores &best) {
+    const int n1 = descs1.rows, n2 = descs2.rows;
+
+    std::vector<float> tile((size_t)kTileRows * kPanelCols);
+#if defined(XFEAT_X86)
+    // the VNNI panel holds whole groups of 4 dimensions
+    const VnniTileFn vnni = descs1.cols % 4 == 0 ? VnniKernel() : nullptr;
+    std::vector<uint8_t> panel(vnni ? (size_t)descs1.cols * kPanelCols : 0);
+#endif
+    for (int c0 = 0; c0 < n2; c0 += kPanelCols) {
+        const int nc = std::min(kPanelCols, n2 - c0);
+#if defined(XFEAT_X86)
+        if (vnni) {
+            PackPanelInt8(descs2, c0, nc, panel.data());
+        }
+#endif
+        for (int r0 = 0; r0 < n1; r0 += kTileRows) {
+            const int nr = std::min(kTileRows, n1 - r0);
+#if defined(XFEAT_X86)
+            if (vnni) {
+                vnni(descs1, r0, nr, panel.data(), tile.data());
+            } else {
+                ScoreTileInt8(descs1, r0, nr, descs2, c0, nc, tile.data());
+            }
+#else
+            ScoreTileInt8(descs1, r0, nr, descs2, c0, nc, tile.data());
+#endif
+            ReduceTile(tile.data(), r0, nr, c0, nc, best);
+        }
+    }
+}
+
+
+// Rows are split into stripes of whole tiles that are reduced in parallel, each stripe against all columns with
+// its own column bests. Stripes are merged in row order with the same strict '>' rule, so that the result is
+// identical to the single threaded pass. stripeBest(r0, r1, stripe) fills the bests of rows [r0, r1).
+template <typename StripeFn>
+static void ParallelBestMatches(int n1, int n2, bool top2, StripeFn stripeBest, BestScores &best) {
+    best.Init(n1, n2, top2);
+    const int tiles = (n1 + kTileRows - 1) / kTileRows;
+    const int nstripes = std::min(std::max(cv::getNumThreads(), 1), tiles);
+    if (nstripes <= 1) {
+        stripeBest(0, n1, best);
+        return;
+    }
+
+    auto stripeBegin = [&](int s) { return std::min(n1, tiles * s / nstripes * kTileRows); };
+    std::vector<BestScores> stripes(nstripes);
+    cv::parallel_for_(cv::Range(0, nstripes), [&](const cv::Range &range) {
+        for (int s = range.start; s < range.end; ++s) {
+            stripes[s].Init(stripeBegin(s + 1) - stripeBegin(s), n2, top2);
+            stripeBest(stripeBegin(s), stripeBegin(s + 1), stripes[s]);
+        }
+    }, nstripes);
+
+    for (int s = 0; s < nstripes; ++s) {
+        const int r0 = stripeBegin(s);
+        const BestScores &stripe = stripes[s];
+        std::copy(stripe.rowIdx.begin(), stripe.rowIdx.end(), best.rowIdx.begin() + r0);
+        std::copy(stripe.rowMax.begin(), stripe.rowMax.end(), best.rowMax.begin() + r0);
+        std::copy(stripe.rowSecond.begin(), stripe.rowSecond.end(), best.rowSecond.begin() + r0);
+        for (int c = 0; c < n2; ++c) {
+            const float score = stripe.colMax[c];
+            if (score > best.colMax[c]) {
+                if (top2) best.colSecond[c] = std::max(best.colMax[c], stripe.colSecond[c]);
+                best.colMax[c] = score;
+                best.colIdx[c] = r0 + stripe.colIdx[c];
+            } else if (top2) {
+                best.colSecond[c] = std::max(best.colSecond[c], score);
+            }
+        }
+    }
+}
+
+
+// Lowe's ratio test on descriptor distances, d^2 = 2 - 2 * score for L2-normalized descriptors
+static inline bool PassRatio(float bestScore, float secondScore, float maxRatio) {
+    return 2.f - 2.f * bestScore < maxRatio * maxRatio * (2.f - 2.f * secondScore);
+}
+
+
+// mutual nearest neighbours above minScore that pass the ratio test on both sides, emit(i, j, score) is called
+// in increasing query order. swapped = true if the column side is the query side.
+template <typename EmitFn>
+static void CrossCheck(const BestScores &best, bool swapped, float minScore, float maxRatio, EmitFn emit) {
+    const auto &queryIdx = swapped ? best.colIdx : best.rowIdx;
+    const auto &queryMax = swapped ? best.colMax : best.rowMax;
+    const auto &querySecond = swapped ? best.colSecond : best.rowSecond;
+    const auto &trainIdx = swapped ? best.rowIdx : best.colIdx;
+    const auto &trainSecond = swapped ? best.rowSecond : best.colSecond;
+    for (int i = 0; i < (int)queryIdx.size(); i++) {
+        int j = queryIdx[i];
+        if (j < 0 || trainIdx[j] != i || queryMax[i] <= minScore) {
+            continue;
+        }
+        if (best.top2 && !(PassRatio(queryMax[i], querySecond[i], maxRatio) &&
+                           PassRatio(queryMax[i], trainSecond[j], maxRatio))) {
+            continue;
+        }
+        emit(i, j, queryMax[i]);
+    }
+}
+
+
+static void CrossCheck(const BestScores &best, bool swapped, std::vector<cv::DMatch> &matches,
+                       float minScore, float maxRatio) {
+    matches.clear();
+    CrossCheck(best, swapped, minScore, maxRatio, [&](int i, int j, float s) { matches.emplace_back(i, j, s); });
+}
+
+
+static void CrossCheck(const BestScores &best, bool swapped, const std::vector<cv::KeyPoint> &keys1,
+                       const std::vector<cv::KeyPoint> &keys2, MatchSet &matches, float minScore, float maxRatio) {
+    matches.Clear();
+    CrossCheck(best, swapped, minScore, maxRatio, [&](int i, int j, float s) {
+        matches.queryIdx.push_back(i);
+        matches.trainIdx.push_back(j);
+        matches.scores.push_back(s);
+        matches.ptsQuery.push_back(keys1[i].pt);
+        matches.ptsTrain.push_back(keys2[j].pt);
+    });
+}
+
+
+// streams descs against packed. Returns false if a set is empty.
+static bool PreparedBestMatches(const cv::Mat &descs, const PreparedDescriptors &packed, float maxRatio,
+                                BestScores &best) {
+    if (descs.empty() || packed.Empty()) {
+        return false;
+    }
+    assert(descs.cols == packed.Dim());
+
+    ParallelBestMatches(descs.rows, packed.Rows(), maxRatio < 1.f, [&](int r0, int r1, BestScores &stripe) {
+        BestMatches(descs.rowRange(r0, r1), packed.Rows(), [&](int p) { return packed.Panel(p); }, stripe);
+    }, best);
+    return true;
+}
+
+
+// descs2 packed panel by panel while streaming. Returns false if a set is empty.
+static bool StreamBestMatches(const cv::Mat &descs1, const cv::Mat &descs2, float maxRatio, BestScores &best) {
+    if (descs1.empty() || descs2.empty()) {
+        return false;
+    }
+    assert(descs1.cols == descs2.cols);
+
+    const bool int8 = descs1.type() == CV_8S && descs2.type() == CV_8S;
+    ParallelBestMatches(descs1.rows, descs2.rows, maxRatio < 1.f, [&](int r0, int r1, BestScores &stripe) {
+        if (int8) {
+            BestMatchesInt8(descs1.rowRange(r0, r1), descs2, stripe);
+            return;
+        }
+        // descs2 is packed one panel at a time (per stripe), fp16 and int8 rows are converted to fp32 on the fly
+        std::vector<float> panel((size_t)descs2.cols * kPanelCols), buf;
+        auto panelAt = [&](int p) {
+            const int c0 = p * kPanelCols;
+            PackPanel(descs2, c0, std::min(kPanelCols, descs2.rows - c0), panel.data(), buf);
+            return (const float *)panel.data();
+        };
+        BestMatches(descs1.rowRange(r0, r1), descs2.rows, panelAt, stripe);
+    }, best);
+    return true;
+}
+
+
 void Matcher::Match(const cv::Mat &descs1, const cv::Mat &descs2,
-                    std::vector<cv::DMatch> &matches, float minScore) {
-    cv::Mat scores12 = descs1 * descs2.t();
-    cv::Mat scores21 = descs2 * descs1.t();
-    std::vector<int> match12(descs1.rows, -1);
-    for (int i = 0; i < scores12.rows; i++) {
-        auto *row = scores12.ptr<float>(i);
-        float maxScore = row[0];
-        int maxIdx = 0;
-        for (int j = 1; j < scores12.cols; j++) {
-            if (row[j] > maxScore) {
-                maxScore = row[j];
-                maxIdx = j;
+                    std::vector<cv::DMatch> &matches, float minScore, float maxRatio) {
+    BestScores best;
+    matches.clear();
+    if (StreamBestMatches(descs1, descs2, maxRatio, best)) {
+        CrossCheck(best, false, matches, minScore, maxRatio);
+    }
+}
+
+
+void Matcher::Match(const cv::Mat &descs1, const PreparedDescriptors &descs2,
+                    std::vector<cv::DMatch> &matches, float minScore, float maxRatio) {
+    BestScores best;
+    matches.clear();
+    if (PreparedBestMatches(descs1, descs2, maxRatio, best)) {
+        CrossCheck(best, false, matches, minScore, maxRatio);
+    }
+}
+
+
+void Matcher::Match(const PreparedDescriptors &descs1, const cv::Mat &descs2,
+                    std::vector<cv::DMatch> &matches, float minScore, float maxRatio) {
+    BestScores best;
+    matches.clear();
+    if (PreparedBestMatches(descs2, descs1, maxRatio, best)) {
+        CrossCheck(best, true, matches, minScore, maxRatio);
+    }
+}
+
+
+void Matcher::Match(const cv::Mat &descs1, const cv::Mat &descs2, const std::vector<cv::KeyPoint> &keys1,
+                    const std::vector<cv::KeyPoint> &keys2, MatchSet &matches, float minScore, float maxRatio) {
+    BestScores best;
+    matches.Clear();
+    if (StreamBestMatches(descs1, descs2, maxRatio, best)) {
+        CrossCheck(best, false, keys1, keys2, matches, minScore, maxRatio);
+    }
+}
+
+
+void Matcher::Match(const PreparedDescriptors &descs1, const cv::Mat &descs2, const std::vector<cv::KeyPoint> &keys1,
+                    const std::vector<cv::KeyPoint> &keys2, MatchSet &matches, float minScore, float maxRatio) {
+    BestScores best;
+    matches.Clear();
+    if (PreparedBestMatches(descs2, descs1, maxRatio, best)) {
+        CrossCheck(best, true, keys1, keys2, matches, minScore, maxRatio);
+    }
+}
+
+
+void Matcher::QuantizeDescriptors(const cv::Mat &descs, cv::Mat &qdescs) {
+    // components of L2-normalized descriptors are within [-1, 1], keep the codes symmetric
+    descmath::AsFloat(descs).convertTo(qdescs, CV_8S, kInt8Scale);
+    qdescs = cv::max(qdescs, -kInt8Scale);
+}
+
+
+void Matcher::SignHash(const cv::Mat &descs, std::vector<uint64_t> &hashes) {
+    cv::Mat d = descmath::AsFloat(descs);
+    const int bits = std::min(d.cols, 64);
+    hashes.resize(d.rows);
+    for (int i = 0; i < d.rows; ++i) {
+        const auto *ptr = d.ptr<float>(i);
+        uint64_t h = 0;
+        for (int k = 0; k < bits; ++k) {
+            h |= uint64_t(ptr[k] > 0.f) << k;
+        }
+        hashes[i] = h;
+    }
+}
+
+
+// insert idx with Hamming distance dist into a list of k candidates sorted by distance
+static inline void InsertCandidate(int *dists, int *idxs, int k, int dist, int idx) {
+    int pos = k - 1;
+    while (pos > 0 && dists[pos - 1] > dist) {
+        dists[pos] = dists[pos - 1];
+        idxs[pos] = idxs[pos - 1];
+        --pos;
+    }
+    dists[pos] = dist;
+    idxs[pos] = idx;
+}
+
+
+void Matcher::MatchHashed(const cv::Mat &descs1, const cv::Mat &descs2, std::vector<cv::DMatch> &matches,
+                          float minScore, int candidates) {
+    matches.clear();
+    if (descs1.empty() || descs2.empty()) {
+        return;
+    }
+    assert(descs1.cols == descs2.cols);
+
+    const int n1 = descs1.rows, n2 = descs2.rows;
+    // every query keeps its own candidates, however few queries there are
+    const int k = std::max(1, std::min(candidates, n2));
+    std::vector<uint64_t> hashes1, hashes2;
+    SignHash(descs1, hashes1);
+    SignHash(descs2, hashes2);
+
+    // candidate lists of every row, sorted by Hamming distance. Once a list is filled almost no descriptor
+    // beats its worst candidate, so the distances of a block are computed and tested branch-free first and
+    // only blocks with a hit are inserted one by one.
+    constexpr int kHashBlock = 64;
+    std::vector<int> rowDists((size_t)n1 * k, std::numeric_limits<int>::max()), rowCands((size_t)n1 * k, -1);
+    int dists[kHashBlock];
+    for (int i = 0; i < n1; ++i) {
+        const uint64_t h = hashes1[i];
+        int *rd = &rowDists[(size_t)i * k];
+        int *rc = &rowCands[(size_t)i * k];
+        for (int j0 = 0; j0 < n2; j0 += kHashBlock) {
+            const int nb = std::min(kHashBlock, n2 - j0);
+            const uint64_t *h2 = &hashes2[j0];
+            const int rowWorst = rd[k - 1];
+            int hit = 0;
+            for (int b = 0; b < nb; ++b) {
+                const int dist = std::popcount(h ^ h2[b]);
+                dists[b] = dist;
+                hit |= dist < rowWorst;
+            }
+            if (!hit) {
+                continue;
+            }
+            for (int b = 0; b < nb; ++b) {
+                if (dists[b] < rd[k - 1]) {
+                    InsertCandidate(rd, rc, k, dists[b], j0 + b);
+                }
             }
         }
-        match12[i] = maxIdx;
     }
 
-    std::vector<int> match21(descs2.rows, -1);
-    for (int i = 0; i < scores21.rows; i++) {
-        auto *row = scores21.ptr<float>(i);
-        float maxScore = row[0];
-        int maxIdx = 0;
-        for (int j = 1; j < scores21.cols; j++) {
-            if (row[j] > maxScore) {
-                maxScore = row[j];
-                maxIdx = j;
+    // re-rank the candidates with the exact score, the best row of a column is taken among the rows that
+    // have it as a candidate
+    cv::Mat d1 = descmath::AsFloat(descs1), d2 = descmath::AsFloat(descs2);
+    const int dim = d1.cols;
+    const float lowest = -std::numeric_limits<float>::infinity();
+    std::vector<int> match12(n1, -1), match21(n2, -1);
+    std::vector<float> score12(n1, lowest), score21(n2, lowest);
+    for (int i = 0; i < n1; ++i) {
+        for (int c = 0; c < k; ++c) {
+            const int j = rowCands[(size_t)i * k + c];
+            const float s = descmath::Dot(d1.ptr<float>(i), d2.ptr<float>(j), dim);
+            if (s > score12[i]) {
+                score12[i] = s;
+                match12[i] = j;
+            }
+            if (s > score21[j]) {
+                score21[j] = s;
+                match21[j] = i;
             }
         }
-        match21[i] = maxIdx;
     }
 
     // cross-check
-    matches.clear();
-    for (int i = 0; i < descs1.rows; i++) {
+    for (int i = 0; i < n1; i++) {
         int j = match12[i];
-        if (match21[j] == i && scores12.at<float>(i, j) > minScore) {
-            matches.emplace_back(i, j, scores12.at<float>(i, j));
+        if (j >= 0 && match21[j] == i && score12[i] > minScore) {
+            matches.emplace_back(i, j, score12[i]);
         }
     }
 }
 
 
+// running bests updated with one scored pair. Rows are scored in increasing order, the candidates of a row are
+// not sorted, so row ties go to the smallest index explicitly to keep the order rule of Match.
+static inline void UpdateBest(BestScores &best, int i, int j, float s) {
+    if (s > best.rowMax[i]) {
+        if (best.top2) best.rowSecond[i] = best.rowMax[i];
+        best.rowMax[i] = s;
+        best.rowIdx[i] = j;
+    } else {
+        if (s == best.rowMax[i] && j < best.rowIdx[i]) best.rowIdx[i] = j;
+        if (best.top2 && s > best.rowSecond[i]) best.rowSecond[i] = s;
+    }
+    if (s > best.colMax[j]) {
+        if (best.top2) best.colSecond[j] = best.colMax[j];
+        best.colMax[j] = s;
+        best.colIdx[j] = i;
+    } else if (best.top2 && s > best.colSecond[j]) {
+        best.colSecond[j] = s;
+    }
+}
+
+
+void Matcher::MatchGuided(const std::vector<cv::KeyPoint> &keys1, const cv::Mat &descs1,
+                          const std::vector<cv::KeyPoint> &keys2, const cv::Mat &descs2, const cv::Mat &H,
+                          float radius, std::vector<cv::DMatch> &matches, float minScore, float maxRatio) {
+    matches.clear();
+    const int n1 = descs1.rows, n2 = descs2.rows;
+    if (n1 == 0 || n2 == 0) {
+        return;
+    }
+    assert(descs1.cols == descs2.cols && (int)keys1.size() == n1 && (int)keys2.size() == n2);
+    if (H.cols != 3 || (H.rows != 3 && H.rows != 2) || !(radius > 0.f)) {
+        std::cerr << "MatchGuided: expected a 3x3 homography or a 2x3 affine transform and radius > 0" << std::endl;
+        return;
+    }
+    cv::Mat H64;
+    H.convertTo(H64, CV_64F);
+    cv::Matx33d T = cv::Matx33d::eye();
+    for (int r = 0; r < H64.rows; ++r) {
+        for (int c = 0; c < 3; ++c) {
+            T(r, c) = H64.at<double>(r, c);
+        }
+    }
+    // H and -H are the same homography, with a positive T(2,2) the points in front of it have w > 0
+    if (T(2, 2) < 0) {
+        T *= -1.0;
+    }
+    const double *h = T.val;
+
+    // bucket the keypoints of the second set in cells of at least radius x radius, a window then spans 3 x 3 cells.
+    // The cell is not smaller than 1/256 of the extent, so a tiny radius cannot blow up the grid.
+    float minX = keys2[0].pt.x, minY = keys2[0].pt.y, maxX = minX, maxY = minY;
+    for (const auto &k : keys2) {
+        minX = std::min(minX, k.pt.x);
+        minY = std::min(minY, k.pt.y);
+        maxX = std::max(maxX, k.pt.x);
+        maxY = std::max(maxY, k.pt.y);
+    }
+    const float cellSize = std::max(radius, std::max(maxX - minX, maxY - minY) / 256.f);
+    const float invCell = 1.f / cellSize;
+    const int gw = (int)((maxX - minX) * invCell) + 1, gh = (int)((maxY - minY) * invCell) + 1;
+    std::vector<int> cellStart((size_t)gw * gh + 1, 0), cellKeys(n2);
+    auto cellOf = [&](const cv::Point2f &pt) {
+        return (int)((pt.y - minY) * invCell) * gw + (int)((pt.x - minX) * invCell);
+    };
+    for (const auto &k : keys2) {
+        ++cellStart[cellOf(k.pt) + 1];
+    }
+    for (size_t c = 1; c < cellStart.size(); ++c) {
+        cellStart[c] += cellStart[c - 1];
+    }
+    std::vector<int> fill(cellStart.begin(), cellStart.end() - 1);
+    for (int j = 0; j < n2; ++j) {
+        cellKeys[fill[cellOf(keys2[j].pt)]++] = j;
+    }
+
+    cv::Mat d1 = descmath::AsFloat(descs1), d2 = descmath::AsFloat(descs2);
+    const int dim = d1.cols;
+    const float radius2 = radius * radius;
+    BestScores best;
+    best.Init(n1, n2, maxRatio < 1.f);
+    for (int i = 0; i < n1; ++i) {
+        const cv::Point2f &p = keys1[i].pt;
+        const double w = h[6] * p.x + h[7] * p.y + h[8];
+        if (w <= 1e-9) {
+            continue;
+        }
+        const float u = (float)((h[0] * p.x + h[1] * p.y + h[2]) / w);
+        const float v = (float)((h[3] * p.x + h[4] * p.y + h[5]) / w);
+        if (!(u >= minX - radius && u <= maxX + radius && v >= minY - radius && v <= maxY + radius)) {
+            continue;
+        }
+        const int cx = (int)std::floor((u - minX) * invCell), cy = (int)std::floor((v - minY) * invCell);
+        for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, gh - 1); ++y) {
+            for (int x = std::max(cx - 1, 0); x <= std::min(cx + 1, gw - 1); ++x) {
+                const int c = y * gw + x;
+                for (int k = cellStart[c]; k < cellStart[c + 1]; ++k) {
+                    const int j = cellKeys[k];
+                    const float dx = keys2[j].pt.x - u, dy = keys2[j].pt.y - v;
+                    if (dx * dx + dy * dy <= radius2) {
+                        UpdateBest(best, i, j, descmath::Dot(d1.ptr<float>(i), d2.ptr<float>(j), dim));
+                    }
+                }
+            }
+        }
+    }
+    CrossCheck(best, false, matches, minScore, maxRatio);
+}
+
+
+void Matcher::MatchStereo(const std::vector<cv::KeyPoint> &keysL, const cv::Mat &descsL,
+                          const std::vector<cv::KeyPoint> &keysR, const cv::Mat &descsR,
+                          std::vector<cv::DMatch> &matches, float maxDy, float minDisparity, float maxDisparity,
+                          float minScore, float maxRatio) {
+    matches.clear();
+    const int nL = descsL.rows, nR = descsR.rows;
+    if (nL == 0 || nR == 0) {
+        return;
+    }
+    assert(descsL.cols == descsR.cols && (int)keysL.size() == nL && (int)keysR.size() == nR);
+    maxDy = std::max(maxDy, 0.f);
+
+    // right keypoints sorted by row band, then by x, so that a disparity range is a contiguous run of a band
+    const float bandHeight = std::max(maxDy, 1.f);
+    float minY = keysR[0].pt.y;
+    for (const auto &k : keysR) {
+        minY = std::min(minY, k.pt.y);
+    }
+    auto bandOf = [&](float y) { return (int)std::floor((y - minY) / bandHeight); };
+    std::vector<int> order(nR);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        const int ba = bandOf(keysR[a].pt.y), bb = bandOf(keysR[b].pt.y);
+        return ba != bb ? ba < bb : keysR[a].pt.x < keysR[b].pt.x;
+    });
+    const int numBands = bandOf(keysR[order.back()].pt.y) + 1;
+    std::vector<int> bandStart(numBands + 1, 0);
+    for (int j : order) {
+        ++bandStart[bandOf(keysR[j].pt.y) + 1];
+    }
+    for (int b = 0; b < numBands; ++b) {
+        bandStart[b + 1] += bandStart[b];
+    }
+
+    cv::Mat dL = descmath::AsFloat(descsL), dR = descmath::AsFloat(descsR);
+    const int dim = dL.cols;
+    BestScores best;
+    best.Init(nL, nR, maxRatio < 1.f);
+    for (int i = 0; i < nL; ++i) {
+        const cv::Point2f &p = keysL[i].pt;
+        const float xMin = p.x - maxDisparity, xMax = p.x - minDisparity;
+        const int b0 = std::max(bandOf(p.y - maxDy), 0), b1 = std::min(bandOf(p.y + maxDy), numBands - 1);
+        for (int b = b0; b <= b1; ++b) {
+            auto first = std::lower_bound(order.begin() + bandStart[b], order.begin() + bandStart[b + 1], xMin,
+                                          [&](int j, float x) { return keysR[j].pt.x < x; });
+            for (auto it = first; it != order.begin() + bandStart[b + 1] && keysR[*it].pt.x <= xMax; ++it) {
+                const int j = *it;
+                if (std::abs(keysR[j].pt.y - p.y) <= maxDy) {
+                    UpdateBest(best, i, j, descmath::Dot(dL.ptr<float>(i), dR.ptr<float>(j), dim));
+                }
+            }
+        }
+    }
+    CrossCheck(best, false, matches, minScore, maxRatio);
+}
+
+
+void MatchSet::Clear() {
+    queryIdx.clear();
+    trainIdx.clear();
+    scores.clear();
+    ptsQuery.clear();
+    ptsTrain.clear();
+}
+
+
+void MatchSet::Assign(const std::vector<cv::DMatch> &matches, const std::vector<cv::KeyPoint> &keys1,
+                      const std::vector<cv::KeyPoint> &keys2) {
+    Clear();
+    for (const auto &m : matches) {
+        queryIdx.push_back(m.queryIdx);
+        trainIdx.push_back(m.trainIdx);
+        scores.push_back(m.distance);
+        ptsQuery.push_back(keys1[m.queryIdx].pt);
+        ptsTrain.push_back(keys2[m.trainIdx].pt);
+    }
+}
+
+
+void MatchSet::Keep(const std::vector<uchar> &status) {
+    assert((int)status.size() == Size());
+    ReduceVector(queryIdx, status);
+    ReduceVector(trainIdx, status);
+    ReduceVector(scores, status);
+    ReduceVector(ptsQuery, status);
+    ReduceVector(ptsTrain, status);
+}
+
+
+// v = v[indices], the swapped out buffer is kept for the next call
+template <typename T>
+static void Gather(std::vector<T> &v, const std::vector<int> &indices) {
+    thread_local std::vector<T> gathered;
+    gathered.clear();
+    for (int k : indices) {
+        gathered.push_back(v[k]);
+    }
+    v.swap(gathered);
+}
+
+
+void MatchSet::Select(const std::vector<int> &indices) {
+    Gather(queryIdx, indices);
+    Gather(trainIdx, indices);
+    Gather(scores, indices);
+    Gather(ptsQuery, indices);
+    Gather(ptsTrain, indices);
+}
+
+
+void MatchSet::ToDMatches(std::vector<cv::DMatch> &matches) const {
+    matches.clear();
+    for (int k = 0; k < Size(); ++k) {
+        matches.emplace_back(queryIdx[k], trainIdx[k], scores[k]);
+    }
+}
+
+
+bool Matcher::RejectBadMatchesF(MatchSet &matches, float thresh) {
+    if (matches.Size() < 8) {
+        return false;
+    }
+
+    std::vector<uchar> status;
+    cv::findFundamentalMat(matches.ptsQuery, matches.ptsTrain, cv::FM_RANSAC, thresh, 0.999, status);
+    if ((int)status.size() != matches.Size()) {
+        return false;
+    }
+    matches.Keep(status);
+    return true;
+}
+
+
 bool Matcher::RejectBadMatchesF(std::vector<cv::Point2f> &pts1, std::vector<cv::Point2f> &pts2,
                                 std::vector<cv::DMatch> &matches, float thresh) {
     assert(pts1.size()==pts2.size() && pts1.size()==matches.size());
@@ -73,6 +1027,55 @@ bool Matcher::RejectBadMatchesF(std::vector<cv::Point2f> &pts1, std::vector<cv::
     return true;
 }
 
+// Flat buckets: count matches per cell, prefix offsets, scatter the match indices into one array, then keep the
+// maxPerCell smallest keys of every cell with nth_element. The buffers are reused across calls (per thread), so
+// the filter runs in O(n) without allocating. kept lists the selected indices in output order: cells in
+// row-major order, matches of a cell by increasing key.
+template <typename PointFn, typename KeyFn>
+static void GridSelect(int n, PointFn pointAt, KeyFn keyAt, int img_w, int img_h, int gx, int gy, int maxPerCell,
+                       std::vector<int>& kept)
+{
+	kept.clear();
+	if (gx <= 0 || gy <= 0 || maxPerCell <= 0)
+		return;
+
+	thread_local std::vector<int> offsets, cellOf, bucketed;
+	const int numCells = gx * gy;
+	offsets.assign(numCells + 1, 0);
+	cellOf.resize(n);
+	bucketed.resize(n);
+
+	// count
+	for (int k = 0; k < n; ++k) {
+		const cv::Point2f& p = pointAt(k);
+		int cx = std::clamp(int(p.x / img_w * gx), 0, gx - 1);
+		int cy = std::clamp(int(p.y / img_h * gy), 0, gy - 1);
+		cellOf[k] = cy * gx + cx;
+		++offsets[cellOf[k] + 1];
+	}
+	// prefix offsets, offsets[c] is the start of cell c
+	for (int c = 1; c <= numCells; ++c)
+		offsets[c] += offsets[c - 1];
+	// scatter, in input order, afterwards offsets[c] is the end of cell c
+	for (int k = 0; k < n; ++k)
+		bucketed[offsets[cellOf[k]]++] = k;
+
+	auto byKey = [&](int a, int b) {
+		return keyAt(a) < keyAt(b) || (keyAt(a) == keyAt(b) && a < b);
+	};
+	for (int c = 0; c < numCells; ++c) {
+		auto first = bucketed.begin() + (c > 0 ? offsets[c - 1] : 0);
+		auto last = bucketed.begin() + offsets[c];
+		if (last - first > maxPerCell) {
+			std::nth_element(first, first + maxPerCell, last, byKey);
+			last = first + maxPerCell;
+		}
+		std::sort(first, last, byKey);
+		kept.insert(kept.end(), first, last);
+	}
+}
+
+
 void Matcher::gridFilterMatches(
 	const std::vector<cv::KeyPoint>& kps,
 	std::vector<cv::DMatch>& matches,
@@ -80,28 +1083,200 @@ void Matcher::gridFilterMatches(
 	int gx, int gy,
 	int max_per_cell)
 {
-	std::vector<std::vector<std::vector<cv::DMatch>>> grid(
-		gy, std::vector<std::vector<cv::DMatch>>(gx));
-
-	for (const auto& m : matches) {
-		const cv::Point2f& p = kps[m.trainIdx].pt;
-		int cx = std::min(gx - 1, int(p.x / img_w * gx));
-		int cy = std::min(gy - 1, int(p.y / img_h * gy));
-		grid[cy][cx].push_back(m);
+	thread_local std::vector<int> kept;
+	thread_local std::vector<cv::DMatch> selected;
+	GridSelect((int)matches.size(), [&](int k) -> const cv::Point2f& { return kps[matches[k].trainIdx].pt; },
+	           [&](int k) { return matches[k].distance; }, img_w, img_h, gx, gy, max_per_cell, kept);
+	selected.clear();
+	for (int k : kept)
+		selected.push_back(matches[k]);
+	matches.swap(selected);
+}
+
+
+void Matcher::gridFilterMatches(MatchSet& matches, int img_w, int img_h, int gx, int gy, int max_per_cell)
+{
+	thread_local std::vector<int> kept;
+	GridSelect(matches.Size(), [&](int k) -> const cv::Point2f& { return matches.ptsTrain[k]; },
+	           [&](int k) { return matches.scores[k]; }, img_w, img_h, gx, gy, max_per_cell, kept);
+	matches.Select(kept);
+}
+
+// Pose voting in two stages. Pairs of matches vote for a scale and rotation r = dq / dp (as complex numbers) in a
+// fixed log-scale x angle accumulator, which only needs both matches of a pair to be inliers. Every match then votes
+// alone for the frame position of the centre under the dominant r, in a flat open-addressing table of 2D cells.
+namespace {
+
+constexpr int kAngleBins = 24;         // 15 degrees
+constexpr int kScaleBins = 32;         // quarter octaves over [1/16, 16]
+constexpr float kScaleBinsPerOctave = 4.f;
+constexpr float kMinBaseline = 32.f;   // pairs closer than this in the query are too noisy for r
+
+struct VoteCell {
+	int x, y;
+	bool operator==(const VoteCell& o) const { return x == o.x && y == o.y; }
+};
+
+class VoteTable {
+public:
+	// table size a power of two above 4x the votes, so probes stay short
+	void Reset(int votes)
+	{
+		size_t cap = 64;
+		while (cap < (size_t)votes * 4)
+			cap <<= 1;
+		cells_.resize(cap);
+		counts_.assign(cap, 0);
+		mask_ = cap - 1;
+	}
+
+	// returns true for the first vote of c
+	bool Add(const VoteCell& c)
+	{
+		const size_t slot = Find(c);
+		cells_[slot] = c;
+		return ++counts_[slot] == 1;
+	}
+
+	// votes of c and its 8 neighbours, so that a pose on a cell border is not split
+	int Neighbourhood(const VoteCell& c) const
+	{
+		int sum = 0;
+		for (int dy = -1; dy <= 1; ++dy)
+			for (int dx = -1; dx <= 1; ++dx)
+				sum += counts_[Find({c.x + dx, c.y + dy})];
+		return sum;
+	}
+
+private:
+	// slot of c, or the empty slot where it would go
+	size_t Find(const VoteCell& c) const
+	{
+		size_t h = (((size_t)(unsigned)c.x * 73856093u) ^ ((size_t)(unsigned)c.y * 19349663u)) & mask_;
+		while (counts_[h] != 0 && !(cells_[h] == c))
+			h = (h + 1) & mask_;
+		return h;
 	}
 
-	matches.clear();
-	for (auto& row : grid)
-		for (auto& cell : row) {
-			std::sort(cell.begin(), cell.end(),
-				[](const cv::DMatch& a, const cv::DMatch& b) {
-					return a.distance < b.distance;
-				});
-			for (int i = 0; i < std::min((int)cell.size(), max_per_cell); ++i)
-				matches.push_back(cell[i]);
+	std::vector<VoteCell> cells_;
+	std::vector<int> counts_;
+	size_t mask_ = 0;
+};
+
+// dominant scale and rotation of the matches as a complex number, (0, 0) if too few pairs agree
+cv::Point2f DominantSimilarity(const std::vector<cv::Point2f>& p, const std::vector<cv::Point2f>& q, int minVotes)
+{
+	const int n = (int)p.size();
+	int votes[kScaleBins][kAngleBins] = {};
+	float sumX[kScaleBins][kAngleBins] = {}, sumY[kScaleBins][kAngleBins] = {};
+	for (int i = 0; i < n; ++i) {
+		// partners a third and two thirds of the set away
+		for (int k = 1; k <= 2; ++k) {
+			const int j = (i + k * n / 3) % n;
+			const float px = p[j].x - p[i].x, py = p[j].y - p[i].y;
+			const float qx = q[j].x - q[i].x, qy = q[j].y - q[i].y;
+			const float d2 = px * px + py * py, e2 = qx * qx + qy * qy;
+			if (d2 < kMinBaseline * kMinBaseline || e2 <= 0.f)
+				continue;
+			const int s = (int)std::floor(0.5f * std::log2(e2 / d2) * kScaleBinsPerOctave) + kScaleBins / 2;
+			if (s < 0 || s >= kScaleBins)
+				continue;
+			const float rx = (qx * px + qy * py) / d2, ry = (qy * px - qx * py) / d2;
+			const float angle = std::atan2(ry, rx);
+			const int a = ((int)std::floor(angle * (kAngleBins / (2 * (float)CV_PI))) + kAngleBins) % kAngleBins;
+			++votes[s][a];
+			sumX[s][a] += rx;
+			sumY[s][a] += ry;
+		}
+	}
+
+	// best 3 x 3 neighbourhood, angles wrap around
+	int best = 0, bestS = 0, bestA = 0;
+	for (int s = 0; s < kScaleBins; ++s) {
+		for (int a = 0; a < kAngleBins; ++a) {
+			if (votes[s][a] == 0)
+				continue;
+			int sum = 0;
+			for (int ds = std::max(s - 1, 0); ds <= std::min(s + 1, kScaleBins - 1); ++ds)
+				for (int da = -1; da <= 1; ++da)
+					sum += votes[ds][(a + da + kAngleBins) % kAngleBins];
+			if (sum > best) {
+				best = sum;
+				bestS = s;
+				bestA = a;
+			}
 		}
+	}
+	if (best < minVotes)
+		return {0.f, 0.f};
+
+	// mean r of the winning neighbourhood
+	float rx = 0.f, ry = 0.f;
+	for (int ds = std::max(bestS - 1, 0); ds <= std::min(bestS + 1, kScaleBins - 1); ++ds) {
+		for (int da = -1; da <= 1; ++da) {
+			const int a = (bestA + da + kAngleBins) % kAngleBins;
+			rx += sumX[ds][a];
+			ry += sumY[ds][a];
+		}
+	}
+	return {rx / best, ry / best};
 }
 
+} // namespace
+
+
+bool Matcher::voteFilterMatches(MatchSet& matches, const cv::Point2f& center, float cellSize, bool scale,
+	int minVotes)
+{
+	const int n = matches.Size();
+	if (n < 3 || cellSize <= 0.f)
+		return false;
+	const std::vector<cv::Point2f>& p = matches.ptsQuery;
+	const std::vector<cv::Point2f>& q = matches.ptsTrain;
+
+	cv::Point2f r(1.f, 0.f);
+	if (scale) {
+		r = DominantSimilarity(p, q, minVotes);
+		if (r.x == 0.f && r.y == 0.f)
+			return false;
+	}
+
+	thread_local VoteTable table;
+	thread_local std::vector<VoteCell> votes, occupied;
+	thread_local std::vector<uchar> status;
+	table.Reset(n);
+	votes.resize(n);
+	occupied.clear();
+	const float invCell = 1.f / cellSize;
+	for (int i = 0; i < n; ++i) {
+		const float ux = center.x - p[i].x, uy = center.y - p[i].y;
+		const float cx = q[i].x + r.x * ux - r.y * uy;
+		const float cy = q[i].y + r.y * ux + r.x * uy;
+		votes[i] = {(int)std::floor(cx * invCell), (int)std::floor(cy * invCell)};
+		if (table.Add(votes[i]))
+			occupied.push_back(votes[i]);
+	}
+
+	VoteCell best{0, 0};
+	int bestVotes = 0;
+	for (const auto& cell : occupied) {
+		const int sum = table.Neighbourhood(cell);
+		if (sum > bestVotes) {
+			bestVotes = sum;
+			best = cell;
+		}
+	}
+	if (bestVotes < minVotes)
+		return false;
+
+	status.resize(n);
+	for (int i = 0; i < n; ++i)
+		status[i] = std::abs(votes[i].x - best.x) <= 1 && std::abs(votes[i].y - best.y) <= 1;
+	matches.Keep(status);
+	return true;
+}
+
+
 cv::Mat Matcher::reprojectionError(
 	const cv::Mat& H,
 	const std::vector<cv::Point2f>& ptsT,
@@ -141,36 +1316,128 @@ cv::Mat Matcher::numericalJacobian(
 	return J;
 }
 
+// Levenberg-Marquardt over the 8 entries of H with h33 = 1. Points are normalized (centroid, mean distance
+// sqrt(2)) so that the normal equations stay well conditioned, the residuals only change by a constant factor.
 void Matcher::refineHomography(
 	cv::Mat& H,
 	const std::vector<cv::Point2f>& ptsT,
 	const std::vector<cv::Point2f>& ptsF,
 	int iterations)
 {
+	const size_t n = std::min(ptsT.size(), ptsF.size());
 	H.convertTo(H, CV_64F);
+	if (n < 4 || std::abs(H.at<double>(2, 2)) < 1e-12)
+		return;
 
-	for (int i = 0; i < iterations; ++i) {
-		cv::Mat err = reprojectionError(H, ptsT, ptsF);
-		cv::Mat J = numericalJacobian(H, ptsT, ptsF);
+	auto normalization = [n](const std::vector<cv::Point2f>& pts) {
+		double cx = 0, cy = 0, d = 0;
+		for (size_t i = 0; i < n; ++i) {
+			cx += pts[i].x;
+			cy += pts[i].y;
+		}
+		cx /= (double)n;
+		cy /= (double)n;
+		for (size_t i = 0; i < n; ++i)
+			d += std::hypot(pts[i].x - cx, pts[i].y - cy);
+		const double s = d > 0 ? std::sqrt(2.0) * (double)n / d : 1.0;
+		return cv::Matx33d(s, 0, -s * cx, 0, s, -s * cy, 0, 0, 1);
+	};
+	const cv::Matx33d NT = normalization(ptsT), NF = normalization(ptsF);
 
-		cv::Mat delta;
-		cv::solve(J, -err, delta, cv::DECOMP_SVD);
+	cv::Matx33d Hn = NF * cv::Matx33d((const double*)H.ptr<double>()) * NT.inv();
+	Hn *= 1.0 / Hn(2, 2);
+	cv::Vec<double, 8> h;
+	for (int k = 0; k < 8; ++k)
+		h[k] = Hn.val[k];
 
-		// 限制单步更新幅度，避免数值不稳定
-		double delta_norm = cv::norm(delta);
-		const double max_step = 1e-1;
-		if (delta_norm > max_step) {
-			delta *= (max_step / delta_norm);
-		}
+	// squared error, and the normal equations J^T J and J^T r in one pass when A is given. With a = (x, y, 1) / w
+	// the Jacobian rows are (a, 0, -px a01) and (0, a, -py a01), so only the distinct blocks are accumulated.
+	auto evaluate = [&](const cv::Vec<double, 8>& p, cv::Matx<double, 8, 8>* A, cv::Vec<double, 8>* b) {
+		double cost = 0;
+		double S[6] = {0}, Cx[6] = {0}, Cy[6] = {0}, D[3] = {0}, bx[3] = {0}, by[3] = {0}, bp[2] = {0};
+		for (size_t i = 0; i < n; ++i) {
+			const double x = NT(0, 0) * ptsT[i].x + NT(0, 2), y = NT(1, 1) * ptsT[i].y + NT(1, 2);
+			const double u = NF(0, 0) * ptsF[i].x + NF(0, 2), v = NF(1, 1) * ptsF[i].y + NF(1, 2);
+			const double iw = 1.0 / (p[6] * x + p[7] * y + 1.0);
+			const double px = (p[0] * x + p[1] * y + p[2]) * iw, py = (p[3] * x + p[4] * y + p[5]) * iw;
+			const double rx = px - u, ry = py - v;
+			cost += rx * rx + ry * ry;
+			if (!A)
+				continue;
 
-		for (int k = 0; k < 9; ++k)
-			H.at<double>(k / 3, k % 3) += delta.at<double>(k);
+			const double a[3] = {x * iw, y * iw, iw};
+			const double gx[2] = {-px * a[0], -px * a[1]}, gy[2] = {-py * a[0], -py * a[1]};
+			S[0] += a[0] * a[0]; S[1] += a[0] * a[1]; S[2] += a[0] * a[2];
+			S[3] += a[1] * a[1]; S[4] += a[1] * a[2]; S[5] += a[2] * a[2];
+			for (int r = 0; r < 3; ++r) {
+				Cx[2 * r] += a[r] * gx[0];
+				Cx[2 * r + 1] += a[r] * gx[1];
+				Cy[2 * r] += a[r] * gy[0];
+				Cy[2 * r + 1] += a[r] * gy[1];
+				bx[r] += a[r] * rx;
+				by[r] += a[r] * ry;
+			}
+			D[0] += gx[0] * gx[0] + gy[0] * gy[0];
+			D[1] += gx[0] * gx[1] + gy[0] * gy[1];
+			D[2] += gx[1] * gx[1] + gy[1] * gy[1];
+			bp[0] += gx[0] * rx + gy[0] * ry;
+			bp[1] += gx[1] * rx + gy[1] * ry;
+		}
+		if (A) {
+			static const int tri[3][3] = {{0, 1, 2}, {1, 3, 4}, {2, 4, 5}};
+			*A = cv::Matx<double, 8, 8>();
+			for (int r = 0; r < 3; ++r) {
+				for (int c = 0; c < 3; ++c) {
+					(*A)(r, c) = (*A)(r + 3, c + 3) = S[tri[r][c]];
+				}
+				for (int c = 0; c < 2; ++c) {
+					(*A)(r, 6 + c) = (*A)(6 + c, r) = Cx[2 * r + c];
+					(*A)(r + 3, 6 + c) = (*A)(6 + c, r + 3) = Cy[2 * r + c];
+				}
+				(*b)[r] = bx[r];
+				(*b)[r + 3] = by[r];
+			}
+			(*A)(6, 6) = D[0];
+			(*A)(6, 7) = (*A)(7, 6) = D[1];
+			(*A)(7, 7) = D[2];
+			(*b)[6] = bp[0];
+			(*b)[7] = bp[1];
+		}
+		return cost;
+	};
 
-		// 归一化 homography（消除尺度漂移）
-		if (std::abs(H.at<double>(2,2)) > 1e-12)
-			H /= H.at<double>(2,2);
+	double lambda = 1e-3;
+	for (int it = 0; it < iterations; ++it) {
+		cv::Matx<double, 8, 8> A;
+		cv::Vec<double, 8> b;
+		const double cost = evaluate(h, &A, &b);
 
-		if (cv::norm(delta) < 1e-6)
+		// damp until the step lowers the cost, a rejected step only needs another solve
+		bool improved = false;
+		double newCost = cost;
+		for (int attempt = 0; attempt < 10 && !improved; ++attempt) {
+			cv::Matx<double, 8, 8> D = A;
+			for (int k = 0; k < 8; ++k)
+				D(k, k) += lambda * std::max(A(k, k), 1e-12);
+			const cv::Vec<double, 8> delta = D.solve(-b, cv::DECOMP_CHOLESKY);
+			newCost = evaluate(h + delta, nullptr, nullptr);
+			if (newCost < cost) {
+				h += delta;
+				lambda = std::max(lambda * 0.1, 1e-12);
+				improved = true;
+			} else {
+				lambda *= 10.0;
+			}
+		}
+		// converged once a step no longer lowers the cost noticeably
+		if (!improved || cost - newCost < 1e-6 * cost)
 			break;
 	}
-}
\ No newline at end of file
+
+	for (int k = 0; k < 8; ++k)
+		Hn.val[k] = h[k];
+	Hn(2, 2) = 1.0;
+	cv::Matx33d Hr = NF.inv() * Hn * NT;
+	Hr *= 1.0 / Hr(2, 2);
+	cv::Mat(Hr).copyTo(H);
+}
@@ -4,10 +4,128 @@
 #include <opencv2/opencv.hpp>
 
 
+// Descriptors packed once into the panel layout consumed by the Matcher kernel: panels of kPanelCols
+// descriptors stored dimension-major in 64-byte aligned rows. Use it for a set that is matched many times,
+// e.g. a template matched against every live frame, and call Prepare() again when the set changes.
+class PreparedDescriptors {
+public:
+    static constexpr int kPanelCols = 256;
+
+    PreparedDescriptors() = default;
+
+    explicit PreparedDescriptors(const cv::Mat &descs) { Prepare(descs); }
+
+    void Prepare(const cv::Mat &descs);
+
+    void Clear();
+
+    bool Empty() const { return rows_ == 0; }
+
+    int Rows() const { return rows_; }
+
+    int Dim() const { return dim_; }
+
+    int NumPanels() const { return panels_.rows; }
+
+    // dim x kPanelCols floats, columns past Rows() are zero
+    const float *Panel(int p) const { return panels_.ptr<float>(p); }
+
+private:
+    cv::Mat panels_;
+    int rows_ = 0;
+    int dim_ = 0;
+};
+
+
+// Compact match result: structure of arrays of the matched indices and scores, with the matched points gathered
+// once, so that the geometric stages (RejectBadMatchesF, gridFilterMatches, cv::findHomography) take the point
+// arrays directly. Conversion to cv::DMatch is only needed for drawing.
+struct MatchSet {
+    std::vector<int> queryIdx;
+    std::vector<int> trainIdx;
+    std::vector<float> scores;
+    std::vector<cv::Point2f> ptsQuery;  // keys1[queryIdx[k]].pt
+    std::vector<cv::Point2f> ptsTrain;  // keys2[trainIdx[k]].pt
+
+    int Size() const { return (int)queryIdx.size(); }
+
+    bool Empty() const { return queryIdx.empty(); }
+
+    void Clear();
+
+    void Assign(const std::vector<cv::DMatch> &matches, const std::vector<cv::KeyPoint> &keys1,
+                const std::vector<cv::KeyPoint> &keys2);
+
+    // keeps the entries with a non-zero status, in order
+    void Keep(const std::vector<uchar> &status);
+
+    // entries at indices, in that order
+    void Select(const std::vector<int> &indices);
+
+    void ToDMatches(std::vector<cv::DMatch> &matches) const;
+};
+
+
 class Matcher {
 public:
+    // int8 descriptor codes are round(x * kInt8Scale), their dot products are rescaled by 1 / kInt8Scale^2
+    static constexpr int kInt8Scale = 127;
+
+    // descriptors may be CV_32F, CV_16F or CV_8S (see QuantizeDescriptors). CV_16F rows are converted to fp32
+    // on the fly (F16C when the CPU has AVX2) and accumulated in fp32, so they never need a full float copy.
+    // maxRatio < 1 enables Lowe's ratio test: the best and second best scores of every row and column are
+    // tracked in the same pass, and a match is rejected if on either side its descriptor distance is not
+    // below maxRatio times the distance of the second best candidate.
+    static void Match(const cv::Mat &descs1, const cv::Mat &descs2, std::vector<cv::DMatch> &matches,
+                      float minScore = 0.82f, float maxRatio = 1.f);
+
+    // same as above, with one side packed beforehand, queryIdx always refers to descs1
+    static void Match(const cv::Mat &descs1, const PreparedDescriptors &descs2, std::vector<cv::DMatch> &matches,
+                      float minScore = 0.82f, float maxRatio = 1.f);
+
+    static void Match(const PreparedDescriptors &descs1, const cv::Mat &descs2, std::vector<cv::DMatch> &matches,
+                      float minScore = 0.82f, float maxRatio = 1.f);
+
+    // same as above with the result as a MatchSet, points are gathered from keys1 / keys2
+    static void Match(const cv::Mat &descs1, const cv::Mat &descs2, const std::vector<cv::KeyPoint> &keys1,
+                      const std::vector<cv::KeyPoint> &keys2, MatchSet &matches, float minScore = 0.82f,
+                      float maxRatio = 1.f);
+
+    static void Match(const PreparedDescriptors &descs1, const cv::Mat &descs2, const std::vector<cv::KeyPoint> &keys1,
+                      const std::vector<cv::KeyPoint> &keys2, MatchSet &matches, float minScore = 0.82f,
+                      float maxRatio = 1.f);
 
-    static void Match(const cv::Mat &descs1, const cv::Mat &descs2, std::vector<cv::DMatch> &matches, float minScore = 0.82f);
+    // CV_8S codes of L2-normalized descriptors, 4x smaller than CV_32F. Match() uses an int8 dot product kernel
+    // (AVX512-VNNI / AVX-VNNI / AVX2 vpmaddubsw, depending on the build flags) when both sets are quantized.
+    static void QuantizeDescriptors(const cv::Mat &descs, cv::Mat &qdescs);
+
+    // 64-bit sign hash of every descriptor, bit k is set if dimension k (k < 64) is positive
+    static void SignHash(const cv::Mat &descs, std::vector<uint64_t> &hashes);
+
+    // approximate Match for large sets: every descriptor of descs1 keeps the `candidates` nearest descriptors
+    // of descs2 by Hamming distance of the sign hashes, only those pairs are re-ranked with the exact score and
+    // cross-checked. See MatchBench for the recall against Match.
+    static void MatchHashed(const cv::Mat &descs1, const cv::Mat &descs2, std::vector<cv::DMatch> &matches,
+                            float minScore = 0.82f, int candidates = 8);
+
+    // Match constrained by a predicted transform H from the first to the second image (3x3 homography or 2x3
+    // affine, e.g. the previous frame's homography while tracking): keypoint i of the first set is only scored
+    // against keypoints of the second set within radius pixels of its prediction. The second set is bucketed in
+    // a grid of cells of max(radius, extent / 256) pixels, so the cost is linear in the number of keypoints and
+    // the grid stays bounded for a tiny radius. The mutual check and the ratio test are done among the scored pairs.
+    static void MatchGuided(const std::vector<cv::KeyPoint> &keys1, const cv::Mat &descs1,
+                            const std::vector<cv::KeyPoint> &keys2, const cv::Mat &descs2, const cv::Mat &H,
+                            float radius, std::vector<cv::DMatch> &matches, float minScore = 0.82f,
+                            float maxRatio = 1.f);
+
+    // Match for a rectified stereo pair: left keypoint i is only scored against right keypoints within maxDy rows
+    // and with a disparity xL - xR in [minDisparity, maxDisparity]. Right keypoints are bucketed in row bands
+    // sorted by x, so a disparity range is a binary search plus a short scan. Mutual check, minScore and ratio
+    // test as in Match, among the scored pairs; the epipolar constraint replaces RejectBadMatchesF.
+    static void MatchStereo(const std::vector<cv::KeyPoint> &keysL, const cv::Mat &descsL,
+                            const std::vector<cv::KeyPoint> &keysR, const cv::Mat &descsR,
+                            std::vector<cv::DMatch> &matches, float maxDy = 2.f, float minDisparity = 0.f,
+                            float maxDisparity = 128.f, float minScore = 0.82f, float maxRatio = 1.f);
 
     static bool RejectBadMatchesF(std::vector<cv::Point2f> &pts1,
                                   std::vector<cv::Point2f> &pts2,
@@ -17,6 +135,21 @@ public:
     static void gridFilterMatches(const std::vector<cv::KeyPoint>& kps, std::vector<cv::DMatch>& matches, int img_w, int img_h, int gx = 8, int gy = 8,
         int max_per_cell = 5);
 
+    // MatchSet versions, the points are used as gathered, cells of gridFilterMatches are taken on ptsTrain
+    static bool RejectBadMatchesF(MatchSet &matches, float thresh);
+
+    static void gridFilterMatches(MatchSet &matches, int img_w, int img_h, int gx = 8, int gy = 8,
+        int max_per_cell = 5);
+
+    // Weak geometric consistency before RANSAC: every match votes for the frame position of the query point center
+    // (e.g. the template centre) in cells of cellSize pixels, and the matches voting for the best cell or its
+    // neighbours are kept. With scale, the position is predicted under the dominant scale and rotation, voted by
+    // pairs of matches in log-scale x angle bins first (XFeat keypoints have neither); otherwise under a pure
+    // translation. Returns false (matches unchanged) if a vote has fewer than minVotes. Linear time, the buffers
+    // are reused across calls.
+    static bool voteFilterMatches(MatchSet &matches, const cv::Point2f &center, float cellSize = 32.f,
+        bool scale = true, int minVotes = 8);
+
     static cv::Mat reprojectionError(const cv::Mat& H, const std::vector<cv::Point2f>& ptsT, const std::vector<cv::Point2f>& ptsF);
 
     static cv::Mat numericalJacobian(const cv::Mat& H, const std::vector<cv::Point2f>& ptsT, const std::vector<cv::Point2f>& ptsF, double eps);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+// The x86 SIMD kernels are compiled for their instruction set whatever the build flags and selected at run time, so
+// the default build (XFEAT_NATIVE_ARCH OFF) uses them too, and so does MSVC, which never defines __FMA__ or
+// __F16C__. XFEAT_TARGET(features) compiles one function for the given features on GCC and Clang, MSVC accepts the
+// intrinsics in any function. Such a function may only be called after the matching check below, and intrinsics are
+// not inlined into lambdas, so kernels use plain functions for their helpers.
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define XFEAT_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define XFEAT_TARGET(features)
+#else
+#include <cpuid.h>
+#define XFEAT_TARGET(features) __attribute__((target(features)))
+#endif
+#endif
+
+
+namespace simd {
+
+// AVX2 with FMA and F16C, which every AVX2 CPU has. Target "avx2,fma,f16c".
+inline bool HasAvx2() {
+    static const bool has = cv::checkHardwareSupport(CV_CPU_AVX2) && cv::checkHardwareSupport(CV_CPU_FMA3) &&
+                            cv::checkHardwareSupport(CV_CPU_FP16);
+    return has;
+}
+
+// AVX512-VNNI with AVX512F and BW. Target "avx512f,avx512bw,avx512vnni".
+inline bool HasAvx512Vnni() {
+    static const bool has = cv::checkHardwareSupport(CV_CPU_AVX_512F) &&
+                            cv::checkHardwareSupport(CV_CPU_AVX_512BW) &&
+                            cv::checkHardwareSupport(CV_CPU_AVX_512VNNI);
+    return has;
+}
+
+// AVX-VNNI, the VEX encoded vpdpbusd of CPUs without AVX-512 (CPUID.(7,1):EAX bit 4), which OpenCV does not
+// report. Target "avx2,fma,f16c,avxvnni".
+inline bool HasAvxVnni() {
+    static const bool has = [] {
+#if defined(XFEAT_X86)
+        if (!HasAvx2()) {
+            return false;
+        }
+#if defined(_MSC_VER) && !defined(__clang__)
+        int regs[4];
+        __cpuidex(regs, 7, 1);
+        return ((unsigned)regs[0] >> 4 & 1) != 0;
+#else
+        unsigned eax, ebx, ecx, edx;
+        return __get_cpuid_count(7, 1, &eax, &ebx, &ecx, &edx) && (eax >> 4 & 1) != 0;
+#endif
+#else
+        return false;
+#endif
+    }();
+    return has;
+}
+
+}  // namespace simd
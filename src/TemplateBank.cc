@@ -0,0 +1,90 @@
+#include "TemplateBank.h"
+#include "Geometry.h"
+
+
+int TemplateBank::Add(const std::vector<cv::KeyPoint> &keys, const cv::Mat &descs) {
+    if ((int)keys.size() != descs.rows) {
+        std::cerr << "TemplateBank: " << keys.size() << " keypoints but " << descs.rows << " descriptors" << std::endl;
+        return -1;
+    }
+    if (!descs_.empty() && (descs.cols != descs_.cols || descs.type() != descs_.type())) {
+        std::cerr << "TemplateBank: descriptor format differs from the previous templates" << std::endl;
+        return -1;
+    }
+    if (descs_.empty()) {
+        descs_ = descs.clone();
+    } else if (!descs.empty()) {
+        cv::vconcat(descs_, descs, descs_);
+    }
+    keys_.push_back(keys);
+    offsets_.push_back(offsets_.back() + descs.rows);
+    // templates are added once at startup, repacking the whole stack keeps Match() free of any packing
+    prepared_.Prepare(descs_);
+    return Size() - 1;
+}
+
+
+void TemplateBank::Clear() {
+    descs_.release();
+    offsets_.assign(1, 0);
+    keys_.clear();
+    prepared_.Clear();
+}
+
+
+void TemplateBank::Match(const cv::Mat &frameDescs, std::vector<std::vector<cv::DMatch>> &matches, float minScore,
+                         float maxRatio) const {
+    matches.assign(Size(), {});
+    std::vector<cv::DMatch> stacked;
+    Matcher::Match(prepared_, frameDescs, stacked, minScore, maxRatio);
+
+    // stacked matches come in increasing queryIdx, i.e. template by template
+    int t = 0;
+    for (auto m : stacked) {
+        while (m.queryIdx >= offsets_[t + 1]) {
+            ++t;
+        }
+        m.queryIdx -= offsets_[t];
+        matches[t].push_back(m);
+    }
+}
+
+
+std::vector<int> TemplateBank::TopTemplates(const std::vector<std::vector<cv::DMatch>> &matches, int topK,
+                                            int minMatches) {
+    std::vector<int> order;
+    for (int t = 0; t < (int)matches.size(); ++t) {
+        if ((int)matches[t].size() >= minMatches) {
+            order.push_back(t);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return matches[a].size() > matches[b].size();
+    });
+    if ((int)order.size() > topK) {
+        order.resize(std::max(topK, 0));
+    }
+    return order;
+}
+
+
+int TemplateBank::BestTemplate(const std::vector<cv::KeyPoint> &frameKeys,
+                               const std::vector<std::vector<cv::DMatch>> &matches, int topK, cv::Mat &H,
+                               int &inliers, double reprojThresh, int stopInliers) const {
+    inliers = 0;
+    H.release();
+    // candidates by decreasing match count, the order in which VerifyBatch starts them
+    const std::vector<int> top = TopTemplates(matches, topK);
+    std::vector<MatchSet> sets(top.size());
+    for (size_t k = 0; k < top.size(); ++k) {
+        sets[k].Assign(matches[top[k]], keys_[top[k]], frameKeys);
+    }
+    std::vector<Geometry::Verification> results;
+    const int best = Geometry::VerifyBatch(sets, results, Geometry::Model::Homography, stopInliers, reprojThresh);
+    if (best < 0) {
+        return -1;
+    }
+    inliers = results[best].inlierCount;
+    H = results[best].M;
+    return top[best];
+}
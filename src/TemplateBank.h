@@ -0,0 +1,42 @@
+#pragma once
+
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include "Matcher.h"
+
+
+// K templates (e.g. part variants) stacked into one prepared descriptor set, so that a frame is matched against
+// all of them in a single Matcher pass instead of K. Templates compete for every frame keypoint: the mutual
+// check keeps the best template only, which makes the per-template match counts discriminative. Homographies
+// are then estimated for the few templates with the most matches only.
+class TemplateBank {
+public:
+    // appends a template, returns its index
+    int Add(const std::vector<cv::KeyPoint> &keys, const cv::Mat &descs);
+
+    void Clear();
+
+    int Size() const { return (int)keys_.size(); }
+
+    const std::vector<cv::KeyPoint> &Keys(int t) const { return keys_[t]; }
+
+    // matches[t] holds the matches of template t, queryIdx indexes Keys(t), trainIdx the frame keypoints
+    void Match(const cv::Mat &frameDescs, std::vector<std::vector<cv::DMatch>> &matches, float minScore = 0.82f,
+               float maxRatio = 1.f) const;
+
+    // up to topK template indices with at least minMatches matches, by decreasing match count
+    static std::vector<int> TopTemplates(const std::vector<std::vector<cv::DMatch>> &matches, int topK,
+                                         int minMatches = 4);
+
+    // verifies the topK templates concurrently with Geometry::VerifyBatch and returns the one with the most inliers
+    // (-1 if none), with its homography (template -> frame) and inlier count. stopInliers > 0 accepts the first
+    // template reaching that many inliers and cancels the others.
+    int BestTemplate(const std::vector<cv::KeyPoint> &frameKeys, const std::vector<std::vector<cv::DMatch>> &matches,
+                     int topK, cv::Mat &H, int &inliers, double reprojThresh = 4.0, int stopInliers = 0) const;
+
+private:
+    cv::Mat descs_;
+    std::vector<int> offsets_{0}; // first stacked row of every template, and the total count
+    std::vector<std::vector<cv::KeyPoint>> keys_;
+    PreparedDescriptors prepared_;
+};
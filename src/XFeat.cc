@@ -77,6 +77,23 @@ XFeat::XFeat(const std::string &modelFile) {
 
 
 void XFeat::DetectAndCompute(const cv::Mat &img, std::vector<cv::KeyPoint> &keys, cv::Mat &descs, int maxCorners) {
+    DetectAndCompute(img, keys, descs, maxCorners, cv::Mat());
+}
+
+
+void XFeat::DetectAndCompute(const cv::Mat &img, std::vector<cv::KeyPoint> &keys, cv::Mat &descs, int maxCorners,
+                             const std::vector<cv::Rect> &rois) {
+    cv::Mat mask = cv::Mat::zeros(img.size(), CV_8U);
+    const cv::Rect imgRect(0, 0, img.cols, img.rows);
+    for (const auto &roi : rois) {
+        mask(roi & imgRect).setTo(255);
+    }
+    DetectAndCompute(img, keys, descs, maxCorners, mask);
+}
+
+
+void XFeat::DetectAndCompute(const cv::Mat &img, std::vector<cv::KeyPoint> &keys, cv::Mat &descs, int maxCorners,
+                             const cv::Mat &mask) {
     Timer timer;
     // check image size
     if (img.channels() != inputInfos_[0].shape[1]) {
@@ -92,6 +109,15 @@ void XFeat::DetectAndCompute(const cv::Mat &img, std::vector<cv::KeyPoint> &keys
     const int roiX = (img.cols - W_) / 2;
     const int roiY = (img.rows - H_) / 2;
 
+    // cells outside the mask are skipped in all the post-processing below
+    const bool useMask = !mask.empty();
+    if (useMask && !BuildCellMask(mask, roiX, roiY)) {
+        std::cerr << "Mask mismatch! " << mask.rows << ", " << mask.cols << std::endl;
+        return;
+    }
+    const uchar *cellMaskPtr = useMask ? cellMask_.ptr<uchar>() : nullptr;
+    const uchar *descCellMaskPtr = useMask ? descCellMask_.ptr<uchar>() : nullptr;
+
     // convert image to tensor
     cv::Mat fimg;
     if (img.rows == H_ && img.cols == W_) {
@@ -124,19 +150,19 @@ void XFeat::DetectAndCompute(const cv::Mat &img, std::vector<cv::KeyPoint> &keys
 
     timer.Reset();
     // we shall apply softmax along the 65 channels to get the scores
-    SoftmaxScore(kptScorePtr, Hd8_, Wd8_, 65);
+    SoftmaxScore(kptScorePtr, Hd8_, Wd8_, 65, cellMaskPtr);
     double score_softmax_time = timer.Elapse();
 
     timer.Reset();
     // the keypoint score tensor [1, H/8, W/8, 65], we drop the last channel(dust bin), and convert to [H, W] image
     cv::Mat scoreImg(H_, W_, CV_32F);
     auto *scoreImgPtr = scoreImg.ptr<float>();
-    FlattenScore(kptScorePtr, scoreImgPtr);
+    FlattenScore(kptScorePtr, scoreImgPtr, cellMaskPtr);
     double score_flatten_time = timer.Elapse();
 
     timer.Reset();
     // apply nms, only keep the points with score > 0.05 and is the local maxima in a 5x5 window
-    Nms(scoreImg, 0.05f, nmsKernelSize_, scoredPoints_);
+    Nms(scoreImg, 0.05f, nmsKernelSize_, scoredPoints_, useMask ? cellMask_ : cv::Mat());
     double nms_time = timer.Elapse();
 
     timer.Reset();
@@ -173,6 +199,10 @@ void XFeat::DetectAndCompute(const cv::Mat &img, std::vector<cv::KeyPoint> &keys
         if (pt.x <= minEdgeX || pt.x >= maxEdgeX || pt.y <= minEdgeY || pt.y >= maxEdgeY) {
             continue;
         }
+        // the cell is active, but the pixel itself may still be masked out
+        if (useMask && mask.at<uchar>(pt.y + roiY, pt.x + roiX) == 0) {
+            continue;
+        }
         keys.emplace_back(pt.x, pt.y, 0);
         if (keys.size() >= maxCorners) {
             break;
@@ -185,6 +215,9 @@ void XFeat::DetectAndCompute(const cv::Mat &img, std::vector<cv::KeyPoint> &keys
     // normalize the descriptors along the channel dimension
     timer.Reset();
     for (int i = 0; i < shw; ++i) {
+        if (descCellMaskPtr && descCellMaskPtr[i] == 0) {
+            continue;
+        }
         double sum = 0;
         float *ptr = &descTensorPtr[i * 64];
         for (int j = 0; j < 64; ++j) {
@@ -227,10 +260,97 @@ void XFeat::DetectAndCompute(const cv::Mat &img, std::vector<cv::KeyPoint> &keys
         key.pt.y += static_cast<float>(roiY);
     }
 
+    // project onto the principal components and re-normalize
+    if (!projection_.empty() && !descs.empty()) {
+        cv::Mat reduced = descs * projection_.t();
+        const float *offset = projOffset_.ptr<float>();
+        for (int n = 0; n < reduced.rows; ++n) {
+            float *ptr = reduced.ptr<float>(n);
+            double sum = 0;
+            for (int j = 0; j < reduced.cols; ++j) {
+                ptr[j] -= offset[j];
+                sum += ptr[j] * ptr[j];
+            }
+            float invNorm = static_cast<float>(1.0 / std::max(std::sqrt(sum), 1e-12));
+            for (int j = 0; j < reduced.cols; ++j) {
+                ptr[j] *= invNorm;
+            }
+        }
+        descs = reduced;
+    }
+
+    if (descType_ != CV_32F) {
+        descs.convertTo(descs, descType_);
+    }
+
 }
 
 
-void XFeat::Nms(const cv::Mat &scores, float scoreThresh, int kernelSize, std::vector<ScoredPoint> &points) {
+void XFeat::SetDescriptorType(int type) {
+    if (type != CV_32F && type != CV_16F) {
+        std::cerr << "Unsupported descriptor type! " << type << std::endl;
+        return;
+    }
+    descType_ = type;
+}
+
+
+bool XFeat::LoadProjection(const std::string &file, int dim, bool whiten) {
+    if (dim >= 64) {
+        projection_.release();
+        projOffset_.release();
+        return true;
+    }
+
+    cv::FileStorage fs(file, cv::FileStorage::READ);
+    if (!fs.isOpened()) {
+        std::cerr << "Failed to open projection file: " << file << std::endl;
+        return false;
+    }
+    cv::Mat mean, eigenvectors, eigenvalues;
+    fs["mean"] >> mean;
+    fs["eigenvectors"] >> eigenvectors;
+    fs["eigenvalues"] >> eigenvalues;
+    if (dim <= 0 || mean.total() != 64 || eigenvectors.cols != 64 || eigenvectors.rows < dim ||
+        (whiten && (int)eigenvalues.total() < dim)) {
+        std::cerr << "Invalid projection file or dimension! " << file << ", " << dim << std::endl;
+        return false;
+    }
+
+    eigenvectors.rowRange(0, dim).convertTo(projection_, CV_32F);
+    if (whiten) {
+        // unit variance along every component
+        eigenvalues = eigenvalues.reshape(1, 1);
+        eigenvalues.convertTo(eigenvalues, CV_64F);
+        for (int r = 0; r < dim; ++r) {
+            projection_.row(r) *= 1.0 / std::sqrt(std::max(eigenvalues.at<double>(0, r), 1e-12));
+        }
+    }
+    mean = mean.reshape(1, 1);
+    mean.convertTo(mean, CV_32F);
+    projOffset_ = mean * projection_.t();
+    return true;
+}
+
+
+bool XFeat::BuildCellMask(const cv::Mat &mask, int roiX, int roiY) {
+    if (mask.type() != CV_8UC1 || mask.rows < roiY + H_ || mask.cols < roiX + W_) {
+        return false;
+    }
+
+    // a cell is active if any of its 8x8 pixels is non-zero, INTER_AREA with a factor of 8 is an exact block average
+    cv::Mat binMask = mask(cv::Rect(roiX, roiY, W_, H_)) != 0;
+    cv::resize(binMask, cellMask_, cv::Size(Wd8_, Hd8_), 0, 0, cv::INTER_AREA);
+    cellMask_ = cellMask_ > 0;
+
+    // the bicubic interpolation of a keypoint in cell c reads cells c-2 ... c+2
+    cv::dilate(cellMask_, descCellMask_, cv::getStructuringElement(cv::MORPH_RECT, cv::Size(5, 5)));
+    return true;
+}
+
+
+void XFeat::Nms(const cv::Mat &scores, float scoreThresh, int kernelSize, std::vector<ScoredPoint> &points,
+                const cv::Mat &cellMask) {
     points.clear();
 
     int rows = scores.rows;
@@ -239,6 +359,8 @@ void XFeat::Nms(const cv::Mat &scores, float scoreThresh, int kernelSize, std::v
     cv::Mat mask = cv::Mat::ones(rows, cols, CV_8U);
     const auto * scorePtr = scores.ptr<float>();
     auto* maskPtr = mask.ptr<uchar>();
+    const uchar *cellMaskPtr = cellMask.empty() ? nullptr : cellMask.ptr<uchar>();
+    const int cellCols = cellMask.cols;
 
     std::vector<int> ptrOffsets;
     ptrOffsets.reserve(kernelSize * kernelSize);
@@ -252,7 +374,13 @@ void XFeat::Nms(const cv::Mat &scores, float scoreThresh, int kernelSize, std::v
     }
 
     for (int i = halfKernelSize; i < rows - halfKernelSize; i++) {
+        const uchar *cellRowPtr = cellMaskPtr ? cellMaskPtr + (i >> 3) * cellCols : nullptr;
         for (int j = halfKernelSize; j < cols - halfKernelSize; j++) {
+            if (cellRowPtr && cellRowPtr[j >> 3] == 0) {
+                // jump to the last pixel of this cell
+                j |= 7;
+                continue;
+            }
             int addr = i * cols + j;
             if (maskPtr[addr] == 0) {
                 continue;
@@ -289,9 +417,12 @@ void XFeat::Nms(const cv::Mat &scores, float scoreThresh, int kernelSize, std::v
 }
 
 
-void XFeat::SoftmaxScore(float *score, int h, int w, int c) {
+void XFeat::SoftmaxScore(float *score, int h, int w, int c, const uchar *cellMask) {
     for (int i = 0; i < h; i++) {
         for (int j = 0; j < w; j++) {
+            if (cellMask && cellMask[i * w + j] == 0) {
+                continue;
+            }
             float *ptr = score + i * w * c + j * c;
             float sum = 0;
             for (int k = 0; k < c; ++k) {
@@ -308,13 +439,20 @@ void XFeat::SoftmaxScore(float *score, int h, int w, int c) {
 }
 
 
-void XFeat::FlattenScore(float *src, float *dst) {
+void XFeat::FlattenScore(float *src, float *dst, const uchar *cellMask) {
     for (int i = 0; i < Hd8_; ++i) {
         for (int j = 0; j < Wd8_; ++j) {
             float* src_ptr = src + i * Wd8_ * 65 + j * 65;
             int iRow = i * 8;
             int jCol = j * 8;
             float* dst_ptr = dst +iRow * W_ + jCol;
+            if (cellMask && cellMask[i * Wd8_ + j] == 0) {
+                // masked cells score zero, so they never pass the nms threshold
+                for (int k = 0; k < 8; ++k) {
+                    std::fill(dst_ptr + k * W_, dst_ptr + k * W_ + 8, 0.f);
+                }
+                continue;
+            }
             for (int k = 0; k < 8; ++k) {
                 for (int l = 0; l < 8; ++l) {
                     dst_ptr[k * W_ + l] = src_ptr[k * 8 + l];
@@ -13,6 +13,29 @@ public:
 
     void DetectAndCompute(const cv::Mat &img, std::vector<cv::KeyPoint> &keys, cv::Mat &descs, int maxCorners);
 
+    // type of the descriptors returned by DetectAndCompute, CV_32F (default) or CV_16F (half the memory)
+    void SetDescriptorType(int type);
+
+    int DescriptorType() const { return descType_; }
+
+    // PCA projection saved by PcaTrain (mean, eigenvectors, eigenvalues): descriptors are projected onto the first
+    // dim principal components (e.g. 32 or 16), optionally whitened, and re-normalized. dim >= 64 disables it.
+    bool LoadProjection(const std::string &file, int dim, bool whiten = false);
+
+    int DescriptorDim() const { return projection_.empty() ? 64 : projection_.rows; }
+
+    // network input size, larger images are center-cropped to it
+    cv::Size InputSize() const { return {W_, H_}; }
+
+    // mask: CV_8UC1 with the same size as img, keypoints are only detected where mask is non-zero.
+    // 8x8 cells without any non-zero mask pixel skip softmax, nms and descriptor normalization.
+    void DetectAndCompute(const cv::Mat &img, std::vector<cv::KeyPoint> &keys, cv::Mat &descs, int maxCorners,
+                          const cv::Mat &mask);
+
+    // rois: regions (image coordinates) where keypoints are allowed, everything else is skipped
+    void DetectAndCompute(const cv::Mat &img, std::vector<cv::KeyPoint> &keys, cv::Mat &descs, int maxCorners,
+                          const std::vector<cv::Rect> &rois);
+
 
     struct ScoredPoint {
         int x;
@@ -20,12 +43,17 @@ public:
         float score;
     };
 
-    void Nms(const cv::Mat &scores, float scoreThresh, int kernelSize, std::vector<ScoredPoint>& points);
+    // cellMask: optional CV_8U map of the 8x8 cells of scores, pixels in zero cells are never selected
+    void Nms(const cv::Mat &scores, float scoreThresh, int kernelSize, std::vector<ScoredPoint>& points,
+             const cv::Mat &cellMask = cv::Mat());
 
 private:
-    void SoftmaxScore(float *score, int h, int w, int c);
+    void SoftmaxScore(float *score, int h, int w, int c, const uchar *cellMask = nullptr);
+
+    void FlattenScore(float *src, float *dst, const uchar *cellMask = nullptr);
 
-    void FlattenScore(float *src, float *dst);
+    // build the [H/8, W/8] cell masks from an image mask, returns false if the mask is invalid
+    bool BuildCellMask(const cv::Mat &mask, int roiX, int roiY);
 
     void InterpDescriptor(const float *descMat, float *descriptor, float ptx, float pty);
 
@@ -49,4 +77,15 @@ private:
     const int nmsKernelSize_ = 5;
     std::vector<ScoredPoint> scoredPoints_;
 
+    // descriptor output type
+    int descType_ = CV_32F;
+
+    // optional PCA projection of the descriptors
+    cv::Mat projection_;    // [dim, 64]
+    cv::Mat projOffset_;    // [1, dim], projection of the mean
+
+    // for masked detection
+    cv::Mat cellMask_;      // [H/8, W/8], cells that may yield keypoints
+    cv::Mat descCellMask_;  // cellMask_ dilated by the bicubic footprint, cells whose descriptors are used
+
 };
\ No newline at end of file